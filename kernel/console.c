@@ -107,9 +107,13 @@ consoleread(int user_dst, uint64 dst, int n)
       break;
     }
 
-    // copy the input byte to the user-space buffer.
+    // copy the input byte to the user-space buffer, without
+    // cons.lock, since copyout() may have to page it in.
     cbuf = c;
-    if(either_copyout(user_dst, dst, &cbuf, 1) == -1)
+    release(&cons.lock);
+    int err = either_copyout(user_dst, dst, &cbuf, 1);
+    acquire(&cons.lock);
+    if(err == -1)
       break;
 
     dst++;
@@ -10,8 +10,9 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
-typedef struct HASHMAP_ENTRY_NODE HASHMAP_ENTRY_NODE;
 typedef struct HASHMAP HASHMAP;
+typedef struct PAGE_HASHMAP PAGE_HASHMAP;
+typedef struct HASHMAP_UPDATE_RESULT HASHMAP_UPDATE_RESULT;
 
 // bio.c
 void            binit(void);
@@ -28,6 +29,7 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             execproc(struct proc*, char*, char**);
 
 // file.c
 struct file*    filealloc(void);
@@ -68,6 +70,33 @@ void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
 uint64          getFreeListSize();
+void*           kallocOrder(int);
+void            kfreeOrder(void *, int);
+int             frameRefIncrement(uint64);
+int             frameRefDecrement(uint64);
+int             frameRefCount(uint64);
+void            frameSetFlags(uint64, uint);
+void            frameClearFlags(uint64, uint);
+uint            frameFlags(uint64);
+void            frameAgeTick(void);
+void            frameTouch(uint64, int);
+uint            frameAge(uint64);
+uint            frameWriteAge(uint64);
+
+// slab.c
+void            slabinit(void);
+void*           kmalloc(uint64);
+void            kmfree(void *);
+void            printSlabStats(void);
+
+// swap.c
+void            swapinit(int, struct superblock*);
+int             swapAlloc(uint64);
+void            swapWrite(int);
+void            swapDup(int);
+void            swapFree(int);
+uint64          swapRead(int, uint64);
+void            swapStats(uint64*, uint64*, uint64*, uint64*);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -90,8 +119,10 @@ void            printfinit(void);
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             spawn(char*, char**, int*);
 struct proc*    get_proc_from_pid(int);
 int             growproc(int);
+int             kthread(void (*)(void), char *);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -109,6 +140,7 @@ void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
+void            kyield(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
@@ -138,6 +170,9 @@ char*           safestrcpy(char*, const char*, int);
 int             strlen(const char*);
 int             strncmp(const char*, const char*, uint);
 char*           strncpy(char*, const char*, int);
+uint8           pageEq(uint64, uint64);
+uint8           pageIsZero(uint64);
+void            pageCopy(uint64, uint64);
 
 // syscall.c
 void            argint(int, int*);
@@ -171,40 +206,57 @@ void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
 int             handleCOWPageFault(pagetable_t, uint64);
+int             handleSwapFault(pagetable_t, uint64);
+void            cowRefIncrement(uint64);
+void            cowRefDecrement(uint64, int);
+uint64          cowRefCount(uint64);
+uint64          cowFlags(uint64);
 int             uvmcopy(pagetable_t, pagetable_t, uint64, uint);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
-void            uvmclear(pagetable_t, uint64);
+int             uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
+pte_t *         walkLeaf(pagetable_t, uint64, int *);
+pagetable_t     splitSuperpage(pte_t *);
+uint64          getSuperpageCount();
+uint64          getZeroFrame();
+uint64          uvmrss(pagetable_t, uint64);
+int             frameCharged(uint64);
 uint64          walkaddr(pagetable_t, uint64);
 uint64          va2pa(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 uint64          demand_alloc(pagetable_t, uint64, uint64);
-int             handleDemandPageFault(pagetable_t, uint64);
+int             handleDemandPageFault(pagetable_t, uint64, int);
 
 // vmm.c
 void            vmmInit(void);
-void            randomSampling(void);
+int             reclaimPages(int);
+int             reclaimOwnPages(int);
 
 // hashmap.c
 void            init_hashmap(HASHMAP *);
 int             hashmap_get(HASHMAP *, uint64, void **);
 void            hashmap_put(HASHMAP *, uint64, void *);
-void            hashmap_update(HASHMAP *, uint64, void **(*)(uint8, uint64, void *, va_list), ...);
+void            hashmap_update(HASHMAP *, uint64, void (*)(uint8, uint64, void *, HASHMAP_UPDATE_RESULT *, va_list), ...);
 void            hashmap_delete(HASHMAP *, uint64);
 void            hashmap_iterate(HASHMAP *, void (*)(uint64, void *));
 void            hashmap_free(HASHMAP *);
+uint64          hashmap_contention(HASHMAP *);
+void            hashmapBench(void);
 
 // hashmapPage.c
-void            init_pageHashmap(HASHMAP *);
-int             pageHashmap_get(HASHMAP *, uint64, void **);
-void            pageHashmap_put(HASHMAP *, uint64, void *);
-void            pageHashmap_update(HASHMAP *, uint64, void *(*)(uint8, uint64, void *, va_list), ...);
-void            pageHashmap_delete(HASHMAP *, uint64);
-void            pageHashmap_iterate(HASHMAP *, void (*)(uint64, void *));
-void            pageHashmap_free(HASHMAP *);
+uint64          hashPage(uint64);
+void            init_pageHashmap(PAGE_HASHMAP *);
+int             pageHashmap_get(PAGE_HASHMAP *, uint64, void **);
+int             pageHashmap_getHashed(PAGE_HASHMAP *, uint64, uint64, void **);
+void            pageHashmap_put(PAGE_HASHMAP *, uint64, void *);
+void            pageHashmap_putHashed(PAGE_HASHMAP *, uint64, uint64, void *);
+void            pageHashmap_update(PAGE_HASHMAP *, uint64, void (*)(uint8, uint64, void *, HASHMAP_UPDATE_RESULT *, va_list), ...);
+void            pageHashmap_delete(PAGE_HASHMAP *, uint64);
+void            pageHashmap_iterate(PAGE_HASHMAP *, void (*)(uint64, void *));
+void            pageHashmap_free(PAGE_HASHMAP *);
 
 // plic.c
 void            plicinit(void);
@@ -1,16 +1,62 @@
-// Since this approach uses LL for resolving collisions,
-// `HASH_MAP_SIZE` in `param.h` is preferably chosen to be
-// a prime number to reduce the probability of collision.
+// HASHMAP is an open addressing table with linear probing. Keys and
+// values are kept inline in a power-of-two sized array of slots,
+// which grows as entries are added (see `hashmap.c`).
+//
+// The keys are spread over HASHMAP_SHARDS shards by their hash. Each
+// shard is a table of its own with its own lock, so operations on
+// different shards never wait for each other.
+
+#define HASHMAP_EMPTY        0xFFFFFFFFFFFFFFFFUL // Key of a slot that was never used
+#define HASHMAP_TOMBSTONE    0xFFFFFFFFFFFFFFFEUL // Key of a slot whose entry was deleted
+#define HASHMAP_MIN_CAPACITY (PGSIZE / sizeof(HASHMAP_SLOT))
+#define HASHMAP_SHARD_BITS   3
+#define HASHMAP_SHARDS       (1 << HASHMAP_SHARD_BITS)
 
-typedef struct HASHMAP_ENTRY_NODE {
+// Filled in by the callback of `hashmap_update()`/`pageHashmap_update()`.
+// It lives on the caller's stack, so updates never allocate a result.
+typedef struct HASHMAP_UPDATE_RESULT {
+    void *value;    // New value of the key.
+    uint8 remove;   // If 1, the key is removed instead.
+} HASHMAP_UPDATE_RESULT;
+
+typedef struct HASHMAP_SLOT {
     uint64 key;
     void *value;
-    struct HASHMAP_ENTRY_NODE *next;
-} HASHMAP_ENTRY_NODE;
+} HASHMAP_SLOT;
+
+typedef struct HASHMAP_SHARD {
+    struct spinlock lock;
+    HASHMAP_SLOT *slots;
+    uint capacity;          // Number of slots, a power of two.
+    uint used;              // Slots holding an entry or a tombstone.
+    int size;               // Entries in both tables.
+
+    // Table being emptied into `slots` during a resize, else 0.
+    // Slots below `migrated` have already been moved.
+    HASHMAP_SLOT *oldSlots;
+    uint oldCapacity;
+    uint migrated;
+} HASHMAP_SHARD;
 
 typedef struct HASHMAP {
+    HASHMAP_SHARD shards[HASHMAP_SHARDS];
+    uint64 contended;       // Shard lock acquisitions that found the lock held.
+} HASHMAP;
+
+// Since the page hashmap uses LL for resolving collisions,
+// `PAGE_HASHMAP_SIZE` in `param.h` is preferably chosen to be
+// a prime number to reduce the probability of collision.
+
+typedef struct PAGE_HASHMAP_ENTRY_NODE {
+    uint64 key;
+    uint64 fingerprint; // Content hash of the key page.
+    void *value;
+    struct PAGE_HASHMAP_ENTRY_NODE *next;
+} PAGE_HASHMAP_ENTRY_NODE;
+
+typedef struct PAGE_HASHMAP {
     struct spinlock lock;
-    // Creating `HASH_MAP_SIZE` number of Linked Lists to resolve collisions.
-    HASHMAP_ENTRY_NODE *entries[HASHMAP_SIZE];
+    // Creating `PAGE_HASHMAP_SIZE` number of Linked Lists to resolve collisions.
+    PAGE_HASHMAP_ENTRY_NODE *entries[PAGE_HASHMAP_SIZE];
     int size;
-} HASHMAP;
+} PAGE_HASHMAP;
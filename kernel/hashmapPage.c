@@ -8,37 +8,59 @@
 #define ACCESS_TYPE uint64
 #define GRANULARITY sizeof(ACCESS_TYPE)
 
+#define PRIME64_1 0x9E3779B185EBCA87UL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FUL
+#define PRIME64_3 0x165667B19E3779F9UL
+#define PRIME64_4 0x85EBCA77C2B2AE63UL
+
 // Refer `hashmap.c` for more implementation details.
 
-uint hashPage(uint64 pa) {
-  uint res = 0;
-  for (uint64 address = pa; address < (pa + PGSIZE); address += GRANULARITY) {
-    res += (*((ACCESS_TYPE *) address)) % PAGE_HASHMAP_SIZE; // This is crucial to prevent overflow.
-    res %= PAGE_HASHMAP_SIZE;
-  }
-  return res;
+static inline uint64 rotl64(uint64 x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64 mixRound(uint64 acc, uint64 word) {
+  acc += word * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
 }
 
-uint8 pageEq(uint64 pa1, uint64 pa2) {
-  if (PGROUNDDOWN(pa1) != pa1)
-    panic("pa1 is not the base PA of the page.");
-  if (PGROUNDDOWN(pa2) != pa2)
-    panic("pa2 is not the base PA of the page.");
-
-  if (pa1 == pa2)
-    return 1;
-
-  ACCESS_TYPE *baseAddr1 = (ACCESS_TYPE *) pa1, *baseAddr2 = (ACCESS_TYPE *) pa2;
-  for (uint i = 0; i < PGSIZE; i += GRANULARITY) {
-    if (*baseAddr1 != *baseAddr2)
-      return 0;
-    baseAddr1 += GRANULARITY;
-    baseAddr2 += GRANULARITY;
+static inline uint64 mergeRound(uint64 acc, uint64 lane) {
+  acc ^= mixRound(0, lane);
+  return (acc * PRIME64_1) + PRIME64_4;
+}
+
+// 64-bit fingerprint of the content of the page at `pa`, built like xxHash64:
+// four independent lanes are mixed one word at a time, so it needs no
+// divisions, and word order and position both change the result.
+// The bucket of a page is `fingerprint % PAGE_HASHMAP_SIZE`.
+uint64 hashPage(uint64 pa) {
+  ACCESS_TYPE *word = (ACCESS_TYPE *) pa;
+  uint64 v1 = PRIME64_1 + PRIME64_2, v2 = PRIME64_2, v3 = 0, v4 = 0 - PRIME64_1;
+
+  for (uint i = 0; i < (PGSIZE / GRANULARITY); i += 4, word += 4) {
+    v1 = mixRound(v1, word[0]);
+    v2 = mixRound(v2, word[1]);
+    v3 = mixRound(v3, word[2]);
+    v4 = mixRound(v4, word[3]);
   }
-  return 1;
+
+  uint64 res = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+  res = mergeRound(res, v1);
+  res = mergeRound(res, v2);
+  res = mergeRound(res, v3);
+  res = mergeRound(res, v4);
+  res += PGSIZE;
+
+  res ^= res >> 33;
+  res *= PRIME64_2;
+  res ^= res >> 29;
+  res *= PRIME64_3;
+  res ^= res >> 32;
+  return res;
 }
 
-void init_pageHashmap(HASHMAP *h) {
+void init_pageHashmap(PAGE_HASHMAP *h) {
   if ((PGSIZE % GRANULARITY) != 0)
     panic("PG SIZE is not multiple of GRANULARITY");
   initlock(&h->lock, "page_hashmap_lock");
@@ -50,27 +72,30 @@ void init_pageHashmap(HASHMAP *h) {
   release(&h->lock);
 }
 
-HASHMAP_ENTRY_NODE *get_page_hashmap_entry(HASHMAP *h, uint64 key) {
+// Chains are walked comparing fingerprints first, so `pageEq()`
+// only runs for pages that are almost certainly equal.
+PAGE_HASHMAP_ENTRY_NODE *get_page_hashmap_entry(PAGE_HASHMAP *h, uint64 key, uint64 fingerprint) {
   push_off();
   int locked = holding(&h->lock);
   pop_off();
   if (locked == 0)
     return 0x0;
-  HASHMAP_ENTRY_NODE *entry = h->entries[hashPage(key)];
+  PAGE_HASHMAP_ENTRY_NODE *entry = h->entries[fingerprint % PAGE_HASHMAP_SIZE];
   while (entry != 0x0) {
-    if (pageEq(entry->key, key) == 1)
+    if (entry->fingerprint == fingerprint && pageEq(entry->key, key) == 1)
       return entry;
     entry = entry->next;
   }
   return 0x0;
 }
 
-int pageHashmap_get(HASHMAP *h, uint64 key, void **value) {
+// Same as `pageHashmap_get`, for a caller that already has `hashPage(key)`.
+int pageHashmap_getHashed(PAGE_HASHMAP *h, uint64 key, uint64 fingerprint, void **value) {
   if (PGROUNDDOWN(key) != key)
     panic("Key is not the base PA of the page.");
   int ret = 0;
   acquire(&h->lock);
-  HASHMAP_ENTRY_NODE *entry = get_page_hashmap_entry(h, key);
+  PAGE_HASHMAP_ENTRY_NODE *entry = get_page_hashmap_entry(h, key, fingerprint);
   if (entry != 0x0) {
     *value = entry->value;
     ret = 1;
@@ -79,21 +104,21 @@ int pageHashmap_get(HASHMAP *h, uint64 key, void **value) {
   return ret;
 }
 
-void pageHashmap_put(HASHMAP *h, uint64 key, void *value) {
-  acquire(&h->lock);
-  uint slot = hashPage(key);
-  HASHMAP_ENTRY_NODE *entry = h->entries[slot];
+int pageHashmap_get(PAGE_HASHMAP *h, uint64 key, void **value) {
+  return pageHashmap_getHashed(h, key, hashPage(key), value);
+}
 
-  while (entry != 0x0) {
-    if (pageEq(entry->key, key) == 1) {
-      goto FOUND;
-    }
-    entry = entry->next;
-  }
+// Same as `pageHashmap_put`, for a caller that already has `hashPage(key)`.
+void pageHashmap_putHashed(PAGE_HASHMAP *h, uint64 key, uint64 fingerprint, void *value) {
+  acquire(&h->lock);
+  uint slot = fingerprint % PAGE_HASHMAP_SIZE;
+  PAGE_HASHMAP_ENTRY_NODE *entry = get_page_hashmap_entry(h, key, fingerprint);
+  if (entry != 0x0)
+    goto FOUND;
 
-  if ((entry = ((HASHMAP_ENTRY_NODE *) kalloc())) == 0x0) {
+  if ((entry = ((PAGE_HASHMAP_ENTRY_NODE *) kmalloc(sizeof(PAGE_HASHMAP_ENTRY_NODE)))) == 0x0) {
     if (entry)
-      kfree(entry);
+      kmfree(entry);
     panic("Unable to allocate memory...");
   }
   entry->next = h->entries[slot];
@@ -102,22 +127,30 @@ void pageHashmap_put(HASHMAP *h, uint64 key, void *value) {
 
   FOUND:
   entry->key = key;
+  entry->fingerprint = fingerprint;
   entry->value = value;
   release(&h->lock);
 }
 
-void pageHashmap_update(HASHMAP *h, uint64 key, void *(*update)(uint8, uint64, void *, va_list), ...) {
+void pageHashmap_put(PAGE_HASHMAP *h, uint64 key, void *value) {
+  pageHashmap_putHashed(h, key, hashPage(key), value);
+}
+
+// Same protocol as `hashmap_update()`.
+void pageHashmap_update(PAGE_HASHMAP *h, uint64 key,
+                        void (*update)(uint8, uint64, void *, HASHMAP_UPDATE_RESULT *, va_list), ...) {
+  uint64 fingerprint = hashPage(key);
   acquire(&h->lock);
-  uint slot = hashPage(key);
-  HASHMAP_ENTRY_NODE *entry = h->entries[slot];
-  HASHMAP_ENTRY_NODE *prev = entry;
+  uint slot = fingerprint % PAGE_HASHMAP_SIZE;
+  PAGE_HASHMAP_ENTRY_NODE *entry = h->entries[slot];
+  PAGE_HASHMAP_ENTRY_NODE *prev = entry;
 
-  void **res;
+  HASHMAP_UPDATE_RESULT res = {0x0, 0};
   void *oldVal = 0x0;
 
   uint8 exists = 0;
   while (entry != 0x0) {
-    if (pageEq(entry->key, key) == 1) {
+    if (entry->fingerprint == fingerprint && pageEq(entry->key, key) == 1) {
       exists = 1;
       oldVal = entry->value;
       break;
@@ -128,25 +161,25 @@ void pageHashmap_update(HASHMAP *h, uint64 key, void *(*update)(uint8, uint64, v
 
   va_list params;
   va_start(params, update);
-  res = update(exists, key, oldVal, params);
+  update(exists, key, oldVal, &res, params);
   va_end(params);
 
   if (exists == 1) {
     if (entry == 0x0) { panic("Hashmap Update: Found null enter\n"); }
-    if (((uint64) res[1]) == 1) {
+    if (res.remove == 1) {
       if (prev == entry)
         h->entries[slot] = entry->next;
       prev->next = entry->next;
       h->size -= 1;
-      kfree(entry);
+      kmfree(entry);
     } else {
       entry->key = key;
-      entry->value = res[0];
+      entry->value = res.value;
     }
-  } else if (((uint64) res[1]) != 1) {
-    // Key does not exist, create a new HASHMAP_ENTRY_NODE
-    if ((entry = ((HASHMAP_ENTRY_NODE *) kalloc())) == 0x0) {
-      if (entry) { kfree(entry); } // Unnecessary, but kept to prevent IDE warning.
+  } else if (res.remove != 1) {
+    // Key does not exist, create a new PAGE_HASHMAP_ENTRY_NODE
+    if ((entry = ((PAGE_HASHMAP_ENTRY_NODE *) kmalloc(sizeof(PAGE_HASHMAP_ENTRY_NODE)))) == 0x0) {
+      if (entry) { kmfree(entry); } // Unnecessary, but kept to prevent IDE warning.
       panic("Unable to allocate memory...");
     }
     entry->next = h->entries[slot];
@@ -154,24 +187,25 @@ void pageHashmap_update(HASHMAP *h, uint64 key, void *(*update)(uint8, uint64, v
     h->size += 1;
 
     entry->key = key;
-    entry->value = res[0];
+    entry->fingerprint = fingerprint;
+    entry->value = res.value;
   }
 
-  kfree(res);
   release(&h->lock);
 }
 
-void pageHashmap_delete(HASHMAP *h, uint64 key) {
+void pageHashmap_delete(PAGE_HASHMAP *h, uint64 key) {
+  uint64 fingerprint = hashPage(key);
   acquire(&h->lock);
-  uint slot = hashPage(key);
-  HASHMAP_ENTRY_NODE *entry = h->entries[slot];
-  HASHMAP_ENTRY_NODE *prev = entry;
+  uint slot = fingerprint % PAGE_HASHMAP_SIZE;
+  PAGE_HASHMAP_ENTRY_NODE *entry = h->entries[slot];
+  PAGE_HASHMAP_ENTRY_NODE *prev = entry;
   while (entry != 0x0) {
-    if (pageEq(entry->key, key) == 1) {
+    if (entry->fingerprint == fingerprint && pageEq(entry->key, key) == 1) {
       if (prev == entry)
         h->entries[slot] = entry->next;
       prev->next = entry->next;
-      kfree(entry);
+      kmfree(entry);
       h->size -= 1;
       break;
     }
@@ -181,9 +215,9 @@ void pageHashmap_delete(HASHMAP *h, uint64 key) {
   release(&h->lock);
 }
 
-void pageHashmap_iterate(HASHMAP *h, void (*operate)(uint64, void *)) {
+void pageHashmap_iterate(PAGE_HASHMAP *h, void (*operate)(uint64, void *)) {
   acquire(&h->lock);
-  HASHMAP_ENTRY_NODE *entry;
+  PAGE_HASHMAP_ENTRY_NODE *entry;
   for (uint i = 0; i < PAGE_HASHMAP_SIZE; i++) {
     entry = h->entries[i];
     while (entry) {
@@ -194,16 +228,18 @@ void pageHashmap_iterate(HASHMAP *h, void (*operate)(uint64, void *)) {
   release(&h->lock);
 }
 
-void pageHashmap_free(HASHMAP *h) {
-  // BUG: Refer `hashmap.c`.
+void pageHashmap_free(PAGE_HASHMAP *h) {
+  // Removes all entries. The map stays usable.
   acquire(&h->lock);
   for (uint i = 0; i < PAGE_HASHMAP_SIZE; i++) {
-    HASHMAP_ENTRY_NODE *entry = h->entries[i];
+    PAGE_HASHMAP_ENTRY_NODE *entry = h->entries[i];
     while (entry) {
-      HASHMAP_ENTRY_NODE *temp = entry;
+      PAGE_HASHMAP_ENTRY_NODE *temp = entry;
       entry = entry->next;
-      kfree(temp);
+      kmfree(temp);
     }
+    h->entries[i] = 0x0;
   }
+  h->size = 0;
   release(&h->lock);
 }
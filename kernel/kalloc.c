@@ -1,6 +1,13 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or with kallocOrder() blocks of 2^order contiguous pages.
+//
+// Free memory is kept by a buddy allocator. A free block of order k
+// starts at a frame index that is a multiple of 2^k, and its buddy is
+// the block at index ^ 2^k. Freed blocks are merged with their buddy
+// as long as it is free too. Single pages are served from per-CPU
+// lists, which refill from and flush to the buddy lists in batches.
 
 #include "types.h"
 #include "param.h"
@@ -14,28 +21,153 @@ void freerange(void *pa_start, void *pa_end);
 // First address after kernel. Set by kernel.ld.
 extern char end[];
 
+#define KALLOC_BATCH   32                  // Pages moved per refill/flush
+#define KALLOC_CPU_MAX (2 * KALLOC_BATCH)  // Flush to the global pool above this
+
 struct run {
     struct run *next;
+    struct run *prev;   // Only used on the buddy lists
 };
 
+// Global pool of free pages. Per-CPU lists refill from it in batches.
+struct {
+    struct spinlock lock;
+    struct run *freelist[MAXORDER + 1]; // Free blocks of each order
+    uint64 size;                        // Free pages in all blocks
+} kmem;
+
+// Free pages cached by each CPU. The lock is only contended when
+// another CPU steals from the list.
 struct {
     struct spinlock lock;
     struct run *freelist;
     uint64 size;
-} kmem;
+} kcpus[NCPU];
+
+// Metadata of every physical frame, indexed by (pa - KERNBASE) / PGSIZE.
+// Fields are only accessed atomically, so no lock is needed.
+struct frame {
+    int refcount;   // Number of PTE_COW mappings of the frame
+    uint flags;     // FRAME_* flags, see memlayout.h
+    int order;      // Order of the free buddy block starting here, or -1.
+                    // Protected by kmem.lock.
+    uint lastUsed;      // Sample round the frame was last seen accessed,
+    uint lastWritten;   // and written. See frameTouch().
+};
+
+struct frame frames[NFRAMES];
+
+// Rounds of working set sampling so far. See frameAgeTick().
+static uint sampleRound;
+
+static struct frame *
+pa2frame(uint64 pa) {
+  if (pa < KERNBASE || pa >= PHYSTOP)
+    panic("pa2frame");
+  return &frames[(pa - KERNBASE) / PGSIZE];
+}
+
+#define FRAME2PA(idx) (KERNBASE + (uint64) (idx) * PGSIZE)
+#define PA2FRAME(pa)  (((uint64) (pa) - KERNBASE) / PGSIZE)
+
+static void
+buddyPush(struct run *r, int order) {
+  r->prev = 0x0;
+  r->next = kmem.freelist[order];
+  if (r->next)
+    r->next->prev = r;
+  kmem.freelist[order] = r;
+  frames[PA2FRAME(r)].order = order;
+}
+
+static void
+buddyRemove(struct run *r, int order) {
+  if (r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.freelist[order] = r->next;
+  if (r->next)
+    r->next->prev = r->prev;
+  frames[PA2FRAME(r)].order = -1;
+}
+
+// Take a block of 2^order pages, splitting a larger block if needed.
+// Caller must hold kmem.lock. Returns 0 if no block is large enough.
+static struct run *
+buddyAlloc(int order) {
+  int k = order;
+  while (k <= MAXORDER && kmem.freelist[k] == 0x0)
+    k += 1;
+  if (k > MAXORDER)
+    return 0x0;
+
+  struct run *r = kmem.freelist[k];
+  buddyRemove(r, k);
+  while (k > order) {
+    k -= 1;
+    buddyPush((struct run *) ((char *) r + (PGSIZE << k)), k);
+  }
+  kmem.size -= 1 << order;
+  return r;
+}
+
+// Give back a block of 2^order pages, merging it with its free buddies.
+// Caller must hold kmem.lock.
+static void
+buddyFree(void *pa, int order) {
+  uint64 idx = PA2FRAME(pa);
+  kmem.size += 1 << order;
+  while (order < MAXORDER) {
+    uint64 buddy = idx ^ (1UL << order);
+    if (buddy >= NFRAMES || frames[buddy].order != order)
+      break;
+    buddyRemove((struct run *) FRAME2PA(buddy), order);
+    if (buddy < idx)
+      idx = buddy;
+    order += 1;
+  }
+  buddyPush((struct run *) FRAME2PA(idx), order);
+}
 
 void
 kinit() {
   initlock(&kmem.lock, "kmem");
+  for (int i = 0; i < NCPU; i++)
+    initlock(&kcpus[i].lock, "kmem_cpu");
+  for (int i = 0; i < NFRAMES; i++)
+    frames[i].order = -1;
   freerange(end, (void *) PHYSTOP);
 }
 
+// Add [pa_start, pa_end) to the buddy lists in the largest aligned
+// blocks that fit.
 void
 freerange(void *pa_start, void *pa_end) {
-  char *p;
-  p = (char *) PGROUNDUP((uint64) pa_start);
-  for (; p + PGSIZE <= (char *) pa_end; p += PGSIZE)
-    kfree(p);
+  uint64 p = PGROUNDUP((uint64) pa_start);
+  acquire(&kmem.lock);
+  while (p + PGSIZE <= (uint64) pa_end) {
+    int order = MAXORDER;
+    while (order > 0 && ((PA2FRAME(p) & ((1UL << order) - 1)) != 0 || p + (PGSIZE << order) > (uint64) pa_end))
+      order -= 1;
+    buddyFree((void *) p, order);
+    p += PGSIZE << order;
+  }
+  release(&kmem.lock);
+}
+
+// Move up to n pages from the front of *from to *to.
+// Returns the number of pages moved.
+static int
+moveRuns(struct run **from, struct run **to, int n) {
+  int moved = 0;
+  while (moved < n && *from) {
+    struct run *r = *from;
+    *from = r->next;
+    r->next = *to;
+    *to = r;
+    moved += 1;
+  }
+  return moved;
 }
 
 // Free the page of physical memory pointed at by pa,
@@ -48,17 +180,62 @@ kfree(void *pa) {
 
   if (((uint64) pa % PGSIZE) != 0 || (char *) pa < end || (uint64) pa >= PHYSTOP || (uint64) pa == PRE_KERNEL_ADDRESS)
     panic("kfree");
+  if (__atomic_load_n(&pa2frame((uint64) pa)->refcount, __ATOMIC_ACQUIRE) != 0)
+    panic("kfree: frame still referenced");
+  __atomic_store_n(&pa2frame((uint64) pa)->flags, 0, __ATOMIC_RELEASE);
 
+#ifdef KALLOC_DEBUG
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run *) pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  kmem.size += 1;
-  release(&kmem.lock);
+  push_off();
+  int id = cpuid();
+  acquire(&kcpus[id].lock);
+  r->next = kcpus[id].freelist;
+  kcpus[id].freelist = r;
+  kcpus[id].size += 1;
+  if (kcpus[id].size > KALLOC_CPU_MAX) {
+    acquire(&kmem.lock);
+    for (int i = 0; i < KALLOC_BATCH; i++) {
+      r = kcpus[id].freelist;
+      kcpus[id].freelist = r->next;
+      buddyFree(r, 0);
+    }
+    release(&kmem.lock);
+    kcpus[id].size -= KALLOC_BATCH;
+  }
+  release(&kcpus[id].lock);
+  pop_off();
+}
+
+// Take half of the free pages of some other CPU, keeping one for the
+// caller and caching the rest on CPU `id`. Used once the global pool
+// has run dry. Returns 0 if every list is empty.
+static struct run *
+steal(int id) {
+  struct run *stolen = 0x0;
+  int moved = 0;
+
+  for (int i = 0; i < NCPU && moved == 0; i++) {
+    if (i == id)
+      continue;
+    acquire(&kcpus[i].lock);
+    moved = moveRuns(&kcpus[i].freelist, &stolen, (kcpus[i].size + 1) / 2);
+    kcpus[i].size -= moved;
+    release(&kcpus[i].lock);
+  }
+  if (moved == 0)
+    return 0x0;
+
+  struct run *r = stolen;
+  stolen = r->next;
+  acquire(&kcpus[id].lock);
+  kcpus[id].size += moveRuns(&stolen, &kcpus[id].freelist, moved - 1);
+  release(&kcpus[id].lock);
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -68,24 +245,189 @@ void *
 kalloc(void) {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
+  push_off();
+  int id = cpuid();
+  acquire(&kcpus[id].lock);
+  if (kcpus[id].freelist == 0x0) {
+    acquire(&kmem.lock);
+    for (int i = 0; i < KALLOC_BATCH && (r = buddyAlloc(0)) != 0x0; i++) {
+      r->next = kcpus[id].freelist;
+      kcpus[id].freelist = r;
+      kcpus[id].size += 1;
+    }
+    release(&kmem.lock);
+  }
+  r = kcpus[id].freelist;
   if (r) {
-    kmem.freelist = r->next;
-    kmem.size -= 1;
+    kcpus[id].freelist = r->next;
+    kcpus[id].size -= 1;
   }
-  release(&kmem.lock);
+  release(&kcpus[id].lock);
+  if (r == 0x0)
+    r = steal(id);
+  pop_off();
+  if (r)
+    frameTouch((uint64) r, 1); // A new frame is about to be written.
 
+#ifdef KALLOC_DEBUG
   if (r)
     memset((char *) r, 5, PGSIZE); // fill with junk
+#endif
   return (void *) r;
 }
 
+// Return the pages cached on every CPU to the buddy lists,
+// so that they can merge into larger blocks.
+static void
+drainCpuLists() {
+  for (int i = 0; i < NCPU; i++) {
+    acquire(&kcpus[i].lock);
+    acquire(&kmem.lock);
+    while (kcpus[i].freelist) {
+      struct run *r = kcpus[i].freelist;
+      kcpus[i].freelist = r->next;
+      buddyFree(r, 0);
+    }
+    kcpus[i].size = 0;
+    release(&kmem.lock);
+    release(&kcpus[i].lock);
+  }
+}
+
+// Allocate 2^order physically contiguous pages, aligned to their size.
+// Returns 0 if the memory cannot be allocated.
+void *
+kallocOrder(int order) {
+  struct run *r;
+
+  if (order < 0 || order > MAXORDER)
+    panic("kallocOrder");
+  if (order == 0)
+    return kalloc();
+
+  acquire(&kmem.lock);
+  r = buddyAlloc(order);
+  release(&kmem.lock);
+  if (r == 0x0) {
+    drainCpuLists();
+    acquire(&kmem.lock);
+    r = buddyAlloc(order);
+    release(&kmem.lock);
+  }
+  if (r)
+    frameTouch((uint64) r, 1);
+
+#ifdef KALLOC_DEBUG
+  if (r)
+    memset((char *) r, 5, PGSIZE << order); // fill with junk
+#endif
+  return (void *) r;
+}
+
+// Free a block returned by kallocOrder(order).
+void
+kfreeOrder(void *pa, int order) {
+  if (order < 0 || order > MAXORDER || ((uint64) pa % (PGSIZE << order)) != 0)
+    panic("kfreeOrder");
+  if (order == 0) {
+    kfree(pa);
+    return;
+  }
+  if ((char *) pa < end || (uint64) pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfreeOrder");
+
+  for (uint64 p = (uint64) pa; p < (uint64) pa + (PGSIZE << order); p += PGSIZE) {
+    if (__atomic_load_n(&pa2frame(p)->refcount, __ATOMIC_ACQUIRE) != 0)
+      panic("kfreeOrder: frame still referenced");
+    __atomic_store_n(&pa2frame(p)->flags, 0, __ATOMIC_RELEASE);
+  }
+
+#ifdef KALLOC_DEBUG
+  // Fill with junk to catch dangling refs.
+  memset(pa, 1, PGSIZE << order);
+#endif
+
+  acquire(&kmem.lock);
+  buddyFree(pa, order);
+  release(&kmem.lock);
+}
+
 uint64
 getFreeListSize() {
   uint64 n;
   acquire(&kmem.lock);
   n = kmem.size;
   release(&kmem.lock);
+  for (int i = 0; i < NCPU; i++) {
+    acquire(&kcpus[i].lock);
+    n += kcpus[i].size;
+    release(&kcpus[i].lock);
+  }
   return n;
 }
+
+// Add a reference to the frame at pa. Returns the new count.
+int
+frameRefIncrement(uint64 pa) {
+  return __atomic_add_fetch(&pa2frame(pa)->refcount, 1, __ATOMIC_ACQ_REL);
+}
+
+// Drop a reference to the frame at pa. Returns the new count.
+int
+frameRefDecrement(uint64 pa) {
+  int count = __atomic_sub_fetch(&pa2frame(pa)->refcount, 1, __ATOMIC_ACQ_REL);
+  if (count < 0)
+    panic("frameRefDecrement: negative ref count");
+  return count;
+}
+
+int
+frameRefCount(uint64 pa) {
+  return __atomic_load_n(&pa2frame(pa)->refcount, __ATOMIC_ACQUIRE);
+}
+
+void
+frameSetFlags(uint64 pa, uint flags) {
+  __atomic_or_fetch(&pa2frame(pa)->flags, flags, __ATOMIC_ACQ_REL);
+}
+
+void
+frameClearFlags(uint64 pa, uint flags) {
+  __atomic_and_fetch(&pa2frame(pa)->flags, ~flags, __ATOMIC_ACQ_REL);
+}
+
+uint
+frameFlags(uint64 pa) {
+  return __atomic_load_n(&pa2frame(pa)->flags, __ATOMIC_ACQUIRE);
+}
+
+// Start a new round of working set sampling, which ages every frame by one.
+void
+frameAgeTick() {
+  __atomic_add_fetch(&sampleRound, 1, __ATOMIC_RELAXED);
+}
+
+// Record that the frame at pa was accessed, and written if `write`,
+// in the current sampling round. A superpage is aged by its first frame.
+void
+frameTouch(uint64 pa, int write) {
+  struct frame *f = pa2frame(pa);
+  uint round = __atomic_load_n(&sampleRound, __ATOMIC_RELAXED);
+  __atomic_store_n(&f->lastUsed, round, __ATOMIC_RELAXED);
+  if (write)
+    __atomic_store_n(&f->lastWritten, round, __ATOMIC_RELAXED);
+}
+
+// Sampling rounds since the frame at pa was last accessed.
+uint
+frameAge(uint64 pa) {
+  return __atomic_load_n(&sampleRound, __ATOMIC_RELAXED) -
+         __atomic_load_n(&pa2frame(pa)->lastUsed, __ATOMIC_RELAXED);
+}
+
+// Sampling rounds since the frame at pa was last written.
+uint
+frameWriteAge(uint64 pa) {
+  return __atomic_load_n(&sampleRound, __ATOMIC_RELAXED) -
+         __atomic_load_n(&pa2frame(pa)->lastWritten, __ATOMIC_RELAXED);
+}
@@ -17,6 +17,7 @@ main()
     printf("XV6 kernel is booting\n");
     printf("\n");
     kinit();         // physical page allocator
+    slabinit();      // small object allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
@@ -28,8 +29,11 @@ main()
     iinit();         // inode table
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
-    vmmInit();       // Initialize VMM
     userinit();      // first user process
+    vmmInit();       // Initialize VMM and start its scanner thread
+#ifdef HASHMAP_BENCH
+    hashmapBench();  // time hashmap_update()
+#endif
     __sync_synchronize();
     started = 1;
   } else {
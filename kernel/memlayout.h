@@ -25,8 +25,10 @@
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
 
-// core local interruptor (CLINT), which contains the timer.
+// core local interruptor (CLINT), which contains the timer
+// and the machine-mode software interrupts between harts.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid))
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
@@ -47,6 +49,11 @@
 #define KERNBASE            0x80000000L
 #define PRE_KERNEL_ADDRESS  (KERNBASE - PGSIZE)
 #define PHYSTOP             (KERNBASE + 128*1024*1024)
+#define NFRAMES             ((PHYSTOP - KERNBASE) / PGSIZE)
+
+// Per-frame flags, kept in the frame metadata in kalloc.c.
+#define FRAME_KSM           (1 << 0) // Stable copy of a page merged by the VMM
+#define FRAME_ZERO          (1 << 1) // The shared zero frame, see vm.c
 
 // map the trampoline page to the highest address,
 // in both user and kernel space.
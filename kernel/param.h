@@ -10,7 +10,18 @@
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
 #define FSSIZE                  2000  // size of file system in blocks
+#define SWAPSIZE                4096  // size of the swap area in blocks, after the file system
 #define MAXPATH                  128  // maximum file path name
-#define VMMRANDTICKS            1000  // Number of ticks to wait for during random sampling
-#define HASHMAP_SIZE             251  // NUmber of buckets/slots in the normal hashmap
+#define MAXORDER                   9  // largest buddy block is 2^MAXORDER pages (2 MiB)
+#define VMMRANDTICKS              20  // Number of ticks the VMM scanner idles for when no VM is registered
+#define VMMSCANPAGES              64  // Default number of VM pages scanned for merging per round
+#define VMMSCANRATE              640  // Default maximum number of VM pages scanned per second
+#define SWAPLOWPAGES             256  // The VMM scanner pages out VM pages when fewer pages are free
+#define SWAPBATCH                 32  // Number of pages paged out at a time
+#define WSSINTERVAL               10  // Ticks between two working set samples of the VMs
+#define WSSWINDOW                  5  // A VM page accessed in the last WSSWINDOW samples is in its working set
+#define TICKSPERSEC               10  // Timer interrupts per second (see timerinit() in start.c)
+#define TIMERHZ             10000000  // Cycles per second of the time CSR under qemu
+#define DEFAULTSHARE             100  // CPU share of a process, see vm_share()
+#define MAXSHARE               10000  // Largest CPU share of a process
 #define PAGE_HASHMAP_SIZE        251  // NUmber of buckets/slots in the page hashmap
@@ -10,12 +10,43 @@ struct cpu cpus[NCPU];
 
 struct proc proc[NPROC];
 
+// Per-CPU run queues. A process is on exactly one run queue while it
+// is RUNNABLE and not yet picked by a scheduler, so picking the next
+// process and making one runnable are O(1) instead of a scan of the
+// whole proc table. A process goes back to the queue of the CPU it
+// last ran on, to keep its cache warm, and a CPU whose queue is empty
+// steals from the longest queue. Lock order: p->lock, then the run
+// queue lock.
+//
+// Each queue is kept in order of pass, for stride scheduling: a process
+// that runs advances its pass by the time it ran divided by its share
+// (see vm_share()), and the process with the lowest pass runs next. So
+// runnable processes on one CPU get time in proportion to their shares.
+// The queue's pass is the pass of the process picked last. A process
+// off the queues keeps its pass relative to that, and is placed at the
+// queue's pass plus its own when it becomes runnable again, which lets
+// it move between queues and keeps a process that slept from building
+// up credit. Inserting walks the queue, which holds at most NPROC
+// processes; picking the next process is still O(1).
+struct runq {
+    struct spinlock lock;
+    struct proc *head;
+    uint64 pass;    // Pass of the process picked last
+    int size;
+    int online;     // Non-zero once its CPU runs scheduler()
+    int idle;       // Non-zero while its CPU waits for work in idle()
+    uint64 steals;  // Processes taken from other queues
+};
+
+static struct runq runqs[NCPU];
+
 struct proc *initproc;
 
 int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+extern void kthreadret(void);
 
 static void freeproc(struct proc *p);
 
@@ -50,6 +81,8 @@ procinit(void) {
 
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for (int i = 0; i < NCPU; i++)
+    initlock(&runqs[i].lock, "runq");
   for (p = proc; p < &proc[NPROC]; p++) {
     initlock(&p->lock, "proc");
     p->state = UNUSED;
@@ -75,6 +108,128 @@ mycpu(void) {
   return c;
 }
 
+// Insert p into run queue `rq` by pass, after processes with the same pass.
+static void
+runqPush(struct runq *rq, struct proc *p) {
+  acquire(&rq->lock);
+  p->pass += rq->pass;
+  struct proc **pp = &rq->head;
+  while (*pp && (*pp)->pass <= p->pass)
+    pp = &(*pp)->rqnext;
+  p->rqnext = *pp;
+  *pp = p;
+  rq->size += 1;
+  release(&rq->lock);
+}
+
+// Take the process with the lowest pass off run queue `rq`,
+// or return 0 if it is empty.
+static struct proc *
+runqPop(struct runq *rq) {
+  acquire(&rq->lock);
+  struct proc *p = rq->head;
+  if (p) {
+    rq->head = p->rqnext;
+    p->rqnext = 0;
+    rq->size -= 1;
+    rq->pass = p->pass;
+    p->pass = 0;
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Take the first process off the longest queue other than `self`,
+// or return 0 if every queue is empty.
+static struct proc *
+runqSteal(struct runq *self) {
+  struct runq *victim = 0;
+  for (int i = 0; i < NCPU; i++) {
+    // Unlocked reads: runqPop() copes with a queue emptied meanwhile.
+    struct runq *rq = &runqs[i];
+    if (rq != self && rq->size > 0 && (victim == 0 || rq->size > victim->size))
+      victim = rq;
+  }
+  if (victim == 0)
+    return 0;
+
+  struct proc *p = runqPop(victim);
+  if (p)
+    __sync_fetch_and_add(&self->steals, 1);
+  return p;
+}
+
+// Wake up CPU `id` from wfi, with an IPI through the CLINT.
+// timervec in kernelvec.S passes it on as a software interrupt.
+static void
+cpuwake(int id) {
+  *(uint32 *) CLINT_MSIP(id) = 1;
+}
+
+// Called after putting a process on run queue `rq`. Wakes up the CPU
+// of `rq` if it waits for work, or else any CPU that does, which will
+// steal the process unless the CPU of `rq` gets to it first.
+static void
+runqKick(struct runq *rq) {
+  __sync_synchronize(); // Pairs with idle().
+  if (rq->idle) {
+    cpuwake(rq - runqs);
+    return;
+  }
+  for (int i = 0; i < NCPU; i++) {
+    if (runqs[i].idle) {
+      cpuwake(i);
+      return;
+    }
+  }
+}
+
+// Mark p RUNNABLE and put it on a run queue.
+// That is the queue of the CPU p last ran on, or for a process that
+// never ran, the shortest queue of a CPU that is scheduling,
+// preferring this CPU's on a tie.
+// Caller must hold p->lock.
+static void
+makeRunnable(struct proc *p) {
+  if (!holding(&p->lock))
+    panic("makeRunnable");
+  p->state = RUNNABLE;
+
+  struct runq *rq;
+  if (p->lastcpu >= 0 && runqs[p->lastcpu].online) {
+    rq = &runqs[p->lastcpu];
+  } else {
+    rq = &runqs[cpuid()];
+    for (int i = 0; i < NCPU; i++) {
+      // Unlocked reads: a stale size only makes the choice less even.
+      if (runqs[i].online && runqs[i].size < rq->size)
+        rq = &runqs[i];
+    }
+  }
+  runqPush(rq, p);
+  runqKick(rq);
+}
+
+// Wait for work with wfi, until an interrupt arrives: a timer or device
+// interrupt, or an IPI from runqKick(). Interrupts are off while
+// checking the run queues, so a process made runnable after the check
+// leaves its IPI pending, which ends wfi at once.
+static void
+idle(struct runq *rq) {
+  intr_off();
+  rq->idle = 1;
+  __sync_synchronize(); // Pairs with runqKick().
+
+  int work = 0;
+  for (int i = 0; i < NCPU; i++) {
+    if (runqs[i].size > 0)
+      work = 1;
+  }
+  if (!work)
+    wfi();
+  rq->idle = 0;
+}
+
 // Return the current struct proc *, or zero if none.
 struct proc *
 myproc(void) {
@@ -118,6 +273,10 @@ allocproc(void) {
   found:
   p->pid = allocpid();
   p->state = USED;
+  p->lastcpu = -1;
+  p->share = DEFAULTSHARE;
+  p->pass = 0;
+  p->runtime = 0;
 
   // Allocate a trapframe page.
   if ((p->trapframe = (struct trapframe *) kalloc()) == 0) {
@@ -158,9 +317,14 @@ freeproc(struct proc *p) {
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
+  p->kthread = 0;
+  p->pagesScanned = p->pagesMerged = p->pagesUnmerged = p->pagesSwapped = 0;
+  p->rss = p->rssLimit = 0;
+  p->reclaimVA = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kpreempted = 0;
   p->state = UNUSED;
 }
 
@@ -239,11 +403,22 @@ userinit(void) {
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  makeRunnable(p);
 
   release(&p->lock);
 }
 
+// Whether a process with a memory limit may reserve `sz` bytes: no more
+// than it may keep resident, plus what the swap area can still take.
+static int
+reserveFits(struct proc *p, uint64 sz) {
+  uint64 used, total;
+  if (p->rssLimit == 0)
+    return 1;
+  swapStats(&used, &total, 0, 0);
+  return PGROUNDUP(sz) / PGSIZE <= p->rssLimit + (total - used);
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -253,18 +428,17 @@ growproc(int n) {
 
   sz = p->sz;
   if (n > 0) {
-    /* Different paging modes can be enabled by changing the below `if` condition:
-     *
-     * 1. `(sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0` -- Default Prefetching
-     * 2. `(sz = demand_alloc(p->pagetable, sz, sz + n)) == 0`    -- Demand Paging
+    /* Heap pages are only reserved here and get their memory on first
+     * touch, see `handleDemandPageFault()`, except for aligned 2 MiB
+     * stretches, which get superpages. To allocate them all up front
+     * instead, use `uvmalloc(p->pagetable, sz, sz + n, PTE_W)`.
      */
-    uint64 freePages, requiredPages;
-    if (((freePages = getFreeListSize()) < (requiredPages = (PGROUNDUP(sz + n) / PGSIZE))) ||
-        (freePages - requiredPages) < 10 || (sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if (sz + n > TRAPFRAME || !reserveFits(p, sz + n) || (sz = demand_alloc(p->pagetable, sz, sz + n)) == 0) {
       return -1;
     }
   } else if (n < 0) {
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    if ((sz = uvmdealloc(p->pagetable, sz, sz + n)) != p->sz + n)
+      return -1; // Out of memory splitting a superpage.
   }
   p->sz = sz;
   return 0;
@@ -283,14 +457,18 @@ fork(void) {
     return -1;
   }
 
-  // Copy user memory from parent to child.
-  // COW is disabled by passing `cow = 0` in `uvmcopy`.
-  if (uvmcopy(p->pagetable, np->pagetable, p->sz, 0) < 0) {
+  // Share user memory with the child, copy-on-write.
+  // Pass `cow = 0` to `uvmcopy` to copy it instead.
+  int res = uvmcopy(p->pagetable, np->pagetable, p->sz, 1);
+  if (res < 0) {
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  np->rss = uvmrss(np->pagetable, np->sz);
+  np->rssLimit = p->rssLimit;
+  np->share = p->share;
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -315,7 +493,68 @@ fork(void) {
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  makeRunnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Create a child process running the program at `path`, without
+// copying the caller's memory. If `fds` is 0, the child inherits all
+// open files like with fork(). Otherwise its descriptors 0, 1 and 2
+// are the caller's fds[0], fds[1] and fds[2], where -1 leaves one
+// closed, and nothing else is inherited.
+// Returns the pid of the child, or -1.
+int
+spawn(char *path, char **argv, int *fds) {
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if (fds != 0) {
+    for (int i = 0; i < 3; i++)
+      if (fds[i] != -1 && (fds[i] < 0 || fds[i] >= NOFILE || p->ofile[fds[i]] == 0))
+        return -1;
+  }
+
+  // Allocate process.
+  if ((np = allocproc()) == 0) {
+    return -1;
+  }
+  // Nobody else looks at the child before it has a parent and is
+  // runnable, and exec sleeps, so don't hold its lock meanwhile.
+  release(&np->lock);
+
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  int argc = execproc(np, path, argv);
+  if (argc < 0) {
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->trapframe->a0 = argc;
+  np->rssLimit = p->rssLimit;
+  np->share = p->share;
+
+  if (fds == 0) {
+    for (int i = 0; i < NOFILE; i++)
+      if (p->ofile[i])
+        np->ofile[i] = filedup(p->ofile[i]);
+  } else {
+    for (int i = 0; i < 3; i++)
+      if (fds[i] != -1)
+        np->ofile[i] = filedup(p->ofile[fds[i]]);
+  }
+  np->cwd = idup(p->cwd);
+
+  int pid = np->pid;
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  makeRunnable(np);
   release(&np->lock);
 
   return pid;
@@ -412,14 +651,17 @@ wait(uint64 addr) {
 
         havekids = 1;
         if (pp->state == ZOMBIE) {
-          // Found one.
+          // Found one. Copy out its status without the locks,
+          // since copyout() may have to page addr in. Nobody else
+          // frees a zombie child of p meanwhile.
           pid = pp->pid;
-          if (addr != 0 &&
-              copyout(p->pagetable, addr, (char *) &pp->xstate, sizeof(pp->xstate)) < 0) {
-            release(&pp->lock);
-            release(&wait_lock);
+          int xstate = pp->xstate;
+          release(&pp->lock);
+          release(&wait_lock);
+          if (addr != 0 && copyout(p->pagetable, addr, (char *) &xstate, sizeof(xstate)) < 0)
             return -1;
-          }
+          acquire(&wait_lock);
+          acquire(&pp->lock);
           freeproc(pp);
           release(&pp->lock);
           release(&wait_lock);
@@ -444,7 +686,7 @@ wait(uint64 addr) {
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - take the next process off this CPU's run queue.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -452,30 +694,45 @@ void
 scheduler(void) {
   struct proc *p;
   struct cpu *c = mycpu();
+  struct runq *rq = &runqs[cpuid()];
 
   c->proc = 0;
+  __sync_synchronize();
+  rq->online = 1;
   for (;;) {
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    randomSampling();
+    if ((p = runqPop(rq)) == 0 && (p = runqSteal(rq)) == 0) {
+      idle(rq);
+      continue;
+    }
 
-    for (p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if (p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    acquire(&p->lock);
+    if (p->state != RUNNABLE)
+      panic("scheduler: not runnable");
+
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->lastcpu = cpuid();
+    c->proc = p;
+    uint64 start = r_time();
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    uint64 ran = r_time() - start;
+    p->runtime += ran;
+    p->pass += ran * DEFAULTSHARE / p->share;
+    if (p->state == RUNNABLE) {
+      runqPush(rq, p); // From yield() or kyield().
+      if (rq->size > 1)
+        runqKick(rq); // Others wait too, let an idle CPU steal one.
     }
+    release(&p->lock);
   }
 }
 
@@ -515,6 +772,52 @@ yield(void) {
   release(&p->lock);
 }
 
+// Give up the CPU from a timer interrupt taken while in the kernel.
+// The interrupted code may still hold PTEs or physical addresses
+// of user pages, so mark p to keep the VMM away from its page table.
+void
+kyield(void) {
+  struct proc *p = myproc();
+  acquire(&p->lock);
+  p->state = RUNNABLE;
+  p->kpreempted = 1;
+  sched();
+  p->kpreempted = 0;
+  release(&p->lock);
+}
+
+// Create a kernel thread that runs fn() without any user memory.
+// fn() must never return. Returns the pid of the thread, or -1.
+int
+kthread(void (*fn)(void), char *name) {
+  struct proc *p;
+
+  if ((p = allocproc()) == 0)
+    return -1;
+
+  p->kthread = fn;
+  p->context.ra = (uint64) kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  makeRunnable(p);
+
+  int pid = p->pid;
+  release(&p->lock);
+  return pid;
+}
+
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+void
+kthreadret(void) {
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kthread();
+  panic("kthread returned");
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void
@@ -575,7 +878,7 @@ wakeup(void *chan) {
     if (p != myproc()) {
       acquire(&p->lock);
       if (p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+        makeRunnable(p);
       }
       release(&p->lock);
     }
@@ -595,7 +898,7 @@ kill(int pid) {
       p->killed = 1;
       if (p->state == SLEEPING) {
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        makeRunnable(p);
       }
       release(&p->lock);
       return 0;
@@ -674,7 +977,15 @@ procdump(void) {
       state = states[p->state];
     else
       state = "???";
-    printf("%d %s %s", p->pid, state, p->name);
+    printf("%d %s %s cpu %d share %d", p->pid, state, p->name, p->lastcpu, p->share);
     printf("\n");
   }
+  printf("\nsuperpages: %d\n", (int) getSuperpageCount());
+  printf("run queues (length/steals):");
+  for (int i = 0; i < NCPU; i++) {
+    if (runqs[i].online)
+      printf(" %d/%d", runqs[i].size, (int) runqs[i].steals);
+  }
+  printf("\n");
+  printSlabStats();
 }
@@ -93,10 +93,19 @@ struct proc {
     int killed;                  // If non-zero, have been killed
     int xstate;                  // Exit status to be returned to parent's wait
     int pid;                     // Process ID
+    int kpreempted;              // If non-zero, preempted in the middle of kernel code
+    int lastcpu;                 // CPU that last ran the process, or -1
+    int share;                   // Weight for the CPU time, see vm_share()
+    uint64 runtime;              // CPU time used, in timer cycles
 
     // wait_lock must be held when using this:
     struct proc *parent;         // Parent process
 
+    // the lock of the run queue holding p must be held when using these,
+    // and p->lock while p is on no run queue:
+    struct proc *rqnext;         // Next process on the run queue
+    uint64 pass;                 // Stride scheduling pass, see struct runq in proc.c
+
     // these are private to the process, so p->lock need not be held.
     uint64 kstack;               // Virtual address of kernel stack
     uint64 sz;                   // Size of process memory (bytes)
@@ -106,4 +115,19 @@ struct proc {
     struct file *ofile[NOFILE];  // Open files
     struct inode *cwd;           // Current directory
     char name[16];               // Process name (debugging)
+    uint64 reclaimVA;            // Clock hand of reclaimOwnPages() in vmm.c
+
+    // VM statistics, see vmmstat.h. Updated with atomic adds,
+    // since the VMM scanner changes them too.
+    uint64 pagesScanned;
+    uint64 pagesMerged;
+    uint64 pagesUnmerged;
+    uint64 pagesSwapped;
+
+    // Frames charged, see frameCharged() in vm.c, and the most allowed (0 for no limit).
+    // `rss` is updated with atomic adds, see rssCharge() in vm.c.
+    uint64 rss;
+    uint64 rssLimit;
+
+    void (*kthread)(void);       // Entry point, if this is a kernel thread
 };
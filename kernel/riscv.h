@@ -265,6 +265,13 @@ r_time()
   return x;
 }
 
+// wait until an interrupt is pending, even a disabled one
+static inline void
+wfi()
+{
+  asm volatile("wfi");
+}
+
 // enable device interrupts
 static inline void
 intr_on()
@@ -338,11 +345,16 @@ typedef uint64 *pagetable_t; // 512 PTEs
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+#define SUPERPGSIZE  (512 * PGSIZE) // bytes per superpage (level-1 leaf)
+#define SUPERPGORDER 9              // log2 of pages per superpage
+
 #define PTE_V      (1L << 0) // valid
 #define PTE_R      (1L << 1)
 #define PTE_W      (1L << 2)
 #define PTE_X      (1L << 3)
 #define PTE_U      (1L << 4) // user can access
+#define PTE_A      (1L << 6) // accessed, set by the hardware
+#define PTE_D      (1L << 7) // dirty, set by the hardware
 #define PTE_COW    (1L << 8) // Copy on Write. This is an RSW (Reserved for Supervisor Software) bit. (Sv39 Addressing)
 #define PTE_OLD_W  (1L << 9) // Old Write bit. This is also an RSW bit.
 
@@ -353,6 +365,17 @@ typedef uint64 *pagetable_t; // 512 PTEs
 
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
+// A valid PTE with any of R/W/X set is a leaf, else it points to the next level.
+#define PTE_LEAF(pte) (((pte) & (PTE_R | PTE_W | PTE_X)) != 0)
+
+// A page that was paged out has an invalid PTE with PTE_SWAP set, which
+// keeps its other flags and holds the swap slot in place of the PPN.
+// The hardware ignores every other bit of an invalid PTE.
+#define PTE_SWAP   (1L << 5)
+#define PTE_SWAPPED(pte) (((pte) & (PTE_V | PTE_SWAP)) == PTE_SWAP)
+#define SLOT2PTE(slot) (((uint64) (slot)) << 10)
+#define PTE2SLOT(pte) ((int) ((pte) >> 10))
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK          0x1FF // 9 bits
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
@@ -0,0 +1,248 @@
+// Slab allocator for small kernel objects.
+//
+// Objects of up to SLAB_MAX_SIZE bytes are carved out of whole pages
+// taken from kalloc(). There is one cache per power-of-two object
+// size, and each page of a cache (a slab) starts with a `struct slab`
+// header followed by equally sized objects. kmfree() finds the slab of
+// an object by rounding its address down to the page boundary.
+//
+// Every CPU keeps a small magazine of free objects per cache, so most
+// kmalloc()/kmfree() calls never touch the cache lock. Magazines are
+// refilled from, and flushed to, the cache in batches.
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "defs.h"
+
+#define SLAB_MIN_SHIFT 4                    // 16 bytes
+#define SLAB_MAX_SHIFT 10                   // 1024 bytes
+#define SLAB_MAX_SIZE  (1 << SLAB_MAX_SHIFT)
+#define NSLABCACHE     (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define MAGAZINE_SIZE  16                   // Objects cached per CPU per cache
+#define MAGAZINE_BATCH (MAGAZINE_SIZE / 2)  // Objects moved per refill/flush
+
+struct kmem_cache;
+
+struct object {
+    struct object *next;
+};
+
+// Header at the start of every slab page.
+struct slab {
+    struct kmem_cache *cache;
+    struct slab *prev, *next;   // Partial list of the cache
+    struct object *freelist;
+    uint inuse;
+};
+
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + 15) & ~15)
+
+struct kmem_cache {
+    struct spinlock lock;
+    char *name;
+    uint size;                  // Object size in bytes
+    uint perslab;               // Objects per slab
+    struct slab *partial;       // Slabs with at least one free object
+
+    // Statistics. Protected by lock.
+    uint64 nslabs;              // Slab pages currently owned
+    uint64 refills;             // Magazine refills served
+    uint64 flushes;             // Magazine flushes absorbed
+};
+
+struct magazine {
+    int count;
+    void *objs[MAGAZINE_SIZE];
+
+    // Statistics. Only touched by the owning CPU.
+    uint64 allocs;
+    uint64 frees;
+};
+
+static char *cacheNames[NSLABCACHE] = {
+        "slab-16", "slab-32", "slab-64", "slab-128", "slab-256", "slab-512", "slab-1024"
+};
+static struct kmem_cache caches[NSLABCACHE];
+static struct magazine magazines[NCPU][NSLABCACHE];
+
+void
+slabinit() {
+  for (int i = 0; i < NSLABCACHE; i++) {
+    struct kmem_cache *c = &caches[i];
+    c->size = 1 << (SLAB_MIN_SHIFT + i);
+    c->perslab = (PGSIZE - SLAB_HEADER_SIZE) / c->size;
+    c->partial = 0x0;
+    c->name = cacheNames[i];
+    initlock(&c->lock, c->name);
+  }
+}
+
+// Index of the smallest cache that fits `size` bytes.
+static int
+cacheIndex(uint64 size) {
+  int idx = 0;
+  while ((1UL << (SLAB_MIN_SHIFT + idx)) < size)
+    idx += 1;
+  return idx;
+}
+
+static void
+partialAdd(struct kmem_cache *c, struct slab *s) {
+  s->prev = 0x0;
+  s->next = c->partial;
+  if (c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+static void
+partialRemove(struct kmem_cache *c, struct slab *s) {
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+  s->prev = s->next = 0x0;
+}
+
+// Carve a fresh page into objects and put it on the partial list.
+// Caller must hold c->lock.
+static struct slab *
+slabGrow(struct kmem_cache *c) {
+  struct slab *s = (struct slab *) kalloc();
+  if (s == 0x0)
+    return 0x0;
+
+  s->cache = c;
+  s->inuse = 0;
+  s->freelist = 0x0;
+  char *base = (char *) s + SLAB_HEADER_SIZE;
+  for (int i = c->perslab - 1; i >= 0; i--) {
+    struct object *o = (struct object *) (base + i * c->size);
+    o->next = s->freelist;
+    s->freelist = o;
+  }
+  partialAdd(c, s);
+  c->nslabs += 1;
+  return s;
+}
+
+// Give an object back to its slab, releasing the page once the slab
+// is empty and the cache has other partial slabs. Caller must hold c->lock.
+static void
+slabPut(struct kmem_cache *c, void *obj) {
+  struct slab *s = (struct slab *) PGROUNDDOWN((uint64) obj);
+  if (s->cache != c || s->inuse == 0)
+    panic("kmfree: bad object");
+
+  struct object *o = (struct object *) obj;
+  o->next = s->freelist;
+  s->freelist = o;
+  if (s->inuse == c->perslab)
+    partialAdd(c, s);
+  s->inuse -= 1;
+
+  if (s->inuse == 0 && (s->prev != 0x0 || s->next != 0x0)) {
+    partialRemove(c, s);
+    c->nslabs -= 1;
+    kfree((void *) s);
+  }
+}
+
+// Move up to MAGAZINE_BATCH objects from the cache into the magazine.
+// Returns the number of objects moved.
+static int
+magazineRefill(struct kmem_cache *c, struct magazine *m) {
+  int moved = 0;
+  acquire(&c->lock);
+  while (moved < MAGAZINE_BATCH) {
+    struct slab *s = c->partial;
+    if (s == 0x0 && (s = slabGrow(c)) == 0x0)
+      break;
+    struct object *o = s->freelist;
+    s->freelist = o->next;
+    s->inuse += 1;
+    if (s->inuse == c->perslab)
+      partialRemove(c, s);
+    m->objs[m->count++] = o;
+    moved += 1;
+  }
+  c->refills += 1;
+  release(&c->lock);
+  return moved;
+}
+
+// Move MAGAZINE_BATCH objects from the magazine back to the cache.
+static void
+magazineFlush(struct kmem_cache *c, struct magazine *m) {
+  acquire(&c->lock);
+  for (int i = 0; i < MAGAZINE_BATCH && m->count > 0; i++)
+    slabPut(c, m->objs[--m->count]);
+  c->flushes += 1;
+  release(&c->lock);
+}
+
+// Allocate `size` bytes of kernel memory.
+// Sizes above SLAB_MAX_SIZE get a whole page from kalloc().
+// Returns 0 if the memory cannot be allocated.
+void *
+kmalloc(uint64 size) {
+  if (size > PGSIZE)
+    return 0x0;
+  if (size > SLAB_MAX_SIZE)
+    return kalloc();
+
+  int idx = cacheIndex(size);
+  struct kmem_cache *c = &caches[idx];
+  void *obj = 0x0;
+
+  push_off(); // Stay on this CPU while using its magazine.
+  struct magazine *m = &magazines[cpuid()][idx];
+  if (m->count > 0 || magazineRefill(c, m) > 0) {
+    obj = m->objs[--m->count];
+    m->allocs += 1;
+  }
+  pop_off();
+  return obj;
+}
+
+// Free memory returned by kmalloc().
+void
+kmfree(void *obj) {
+  if (PGROUNDDOWN((uint64) obj) == (uint64) obj) {
+    kfree(obj); // Whole page from kalloc(). Slab objects are never page aligned.
+    return;
+  }
+
+  struct slab *s = (struct slab *) PGROUNDDOWN((uint64) obj);
+  struct kmem_cache *c = s->cache;
+  if (c < caches || c >= &caches[NSLABCACHE])
+    panic("kmfree: not a slab object");
+
+  push_off();
+  struct magazine *m = &magazines[cpuid()][c - caches];
+  if (m->count == MAGAZINE_SIZE)
+    magazineFlush(c, m);
+  m->objs[m->count++] = obj;
+  m->frees += 1;
+  pop_off();
+}
+
+// Print per-cache usage. For debugging.
+void
+printSlabStats() {
+  printf("\ncache      size  slabs  allocs  frees  refills  flushes\n");
+  for (int i = 0; i < NSLABCACHE; i++) {
+    struct kmem_cache *c = &caches[i];
+    uint64 allocs = 0, frees = 0;
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+      allocs += magazines[cpu][i].allocs;
+      frees += magazines[cpu][i].frees;
+    }
+    printf("%s  %d  %d  %d  %d  %d  %d\n",
+           c->name, c->size, (int) c->nslabs, (int) allocs, (int) frees, (int) c->refills, (int) c->flushes);
+  }
+}
@@ -1,4 +1,6 @@
 #include "types.h"
+#include "riscv.h"
+#include "defs.h"
 
 void*
 memset(void *dst, int c, uint n)
@@ -105,3 +107,63 @@ strlen(const char *s)
   return n;
 }
 
+
+// Page sized helpers for the page hashmap, the VMM scanner
+// and the COW fault path. Both pages must be page aligned.
+// They work on 64-bit words, 8 words (64 bytes) per step.
+
+// Returns 1 if the pages at pa1 and pa2 hold the same data.
+// Stops at the first 64-byte block that differs.
+uint8
+pageEq(uint64 pa1, uint64 pa2)
+{
+  if(PGROUNDDOWN(pa1) != pa1 || PGROUNDDOWN(pa2) != pa2)
+    panic("pageEq: not page aligned");
+  if(pa1 == pa2)
+    return 1;
+
+  const uint64 *a = (const uint64 *) pa1;
+  const uint64 *b = (const uint64 *) pa2;
+  for(int i = 0; i < PGSIZE / sizeof(uint64); i += 8){
+    uint64 diff = (a[i] ^ b[i]) | (a[i+1] ^ b[i+1]) |
+                  (a[i+2] ^ b[i+2]) | (a[i+3] ^ b[i+3]) |
+                  (a[i+4] ^ b[i+4]) | (a[i+5] ^ b[i+5]) |
+                  (a[i+6] ^ b[i+6]) | (a[i+7] ^ b[i+7]);
+    if(diff != 0)
+      return 0;
+  }
+  return 1;
+}
+
+// Returns 1 if the page at pa holds only zeros.
+// Stops at the first 64-byte block with a bit set.
+uint8
+pageIsZero(uint64 pa)
+{
+  if(PGROUNDDOWN(pa) != pa)
+    panic("pageIsZero: not page aligned");
+
+  const uint64 *a = (const uint64 *) pa;
+  for(int i = 0; i < PGSIZE / sizeof(uint64); i += 8){
+    if((a[i] | a[i+1] | a[i+2] | a[i+3] | a[i+4] | a[i+5] | a[i+6] | a[i+7]) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+// Copy the page at src to the page at dst.
+void
+pageCopy(uint64 dst, uint64 src)
+{
+  if(PGROUNDDOWN(dst) != dst || PGROUNDDOWN(src) != src)
+    panic("pageCopy: not page aligned");
+
+  uint64 *d = (uint64 *) dst;
+  const uint64 *s = (const uint64 *) src;
+  for(int i = 0; i < PGSIZE / sizeof(uint64); i += 8){
+    uint64 w0 = s[i], w1 = s[i+1], w2 = s[i+2], w3 = s[i+3];
+    uint64 w4 = s[i+4], w5 = s[i+5], w6 = s[i+6], w7 = s[i+7];
+    d[i] = w0; d[i+1] = w1; d[i+2] = w2; d[i+3] = w3;
+    d[i+4] = w4; d[i+5] = w5; d[i+6] = w6; d[i+7] = w7;
+  }
+}
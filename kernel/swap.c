@@ -0,0 +1,195 @@
+// Swap area for pages of the VMs.
+//
+// mkfs reserves SWAPSIZE blocks at the end of the disk, after the file
+// system, and records them in the super block. The area is divided
+// into page-sized slots. A page that is paged out has its PTE replaced
+// by a swap PTE (see PTE_SWAP in riscv.h) naming its slot.
+//
+// A slot is counted by the swap PTEs that name it, so fork() can share
+// a paged out page with the child. While a page is being written out,
+// its frame stays in the slot as a cache. A fault in that window takes
+// the frame back without reading the disk, and the writer frees the
+// slot once it is done.
+//
+// Pages go to the disk directly, not through the buffer cache, so that
+// paging doesn't push the blocks of the file system out of the cache.
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "defs.h"
+
+#define BLOCKSPERPAGE (PGSIZE / BSIZE)
+#define NSLOTS        (SWAPSIZE / BLOCKSPERPAGE)
+
+struct slot {
+    ushort ref;     // Swap PTEs naming the slot
+    uchar writing;  // Page-out in progress
+    uint64 cache;   // Frame being written out, or 0
+};
+
+static struct {
+    struct spinlock lock;
+    uint dev;
+    uint start;     // First block of the swap area
+    uint nslots;    // 0 until swapinit()
+    uint used;
+    struct slot slots[NSLOTS];
+
+    struct sleeplock iolock; // Protects iobuf
+    struct buf iobuf;        // Block being read or written
+
+    // Statistics.
+    uint64 pagesOut;
+    uint64 pagesIn;
+} swap;
+
+void
+swapinit(int dev, struct superblock *sb) {
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.iolock, "swapio");
+  swap.dev = dev;
+  swap.start = sb->swapstart;
+  swap.nslots = sb->nswap / BLOCKSPERPAGE;
+  if (swap.nslots > NSLOTS)
+    swap.nslots = NSLOTS;
+}
+
+static int
+slotFree(struct slot *s) {
+  return s->ref == 0 && s->writing == 0;
+}
+
+// Read or write the page at `pa` from or to slot `idx`.
+static void
+slotIO(int idx, uint64 pa, int write) {
+  struct buf *b = &swap.iobuf;
+  acquiresleep(&swap.iolock);
+  for (int i = 0; i < BLOCKSPERPAGE; i++) {
+    b->dev = swap.dev;
+    b->blockno = swap.start + idx * BLOCKSPERPAGE + i;
+    if (write)
+      memmove(b->data, (char *) pa + i * BSIZE, BSIZE);
+    virtio_disk_rw(b, write);
+    if (!write)
+      memmove((char *) pa + i * BSIZE, b->data, BSIZE);
+  }
+  releasesleep(&swap.iolock);
+}
+
+// Give the frame `pa` to a free slot, to be written out by swapWrite().
+// The caller replaces the only mapping of the frame with a swap PTE.
+// Doesn't sleep. Returns the slot, or -1 if the swap area is full.
+int
+swapAlloc(uint64 pa) {
+  acquire(&swap.lock);
+  for (int i = 0; i < swap.nslots; i++) {
+    struct slot *s = &swap.slots[i];
+    if (slotFree(s)) {
+      s->ref = 1;
+      s->writing = 1;
+      s->cache = pa;
+      swap.used += 1;
+      release(&swap.lock);
+      return i;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// Write out the frame of slot `idx` given by swapAlloc(), then free the
+// frame. Sleeps, so the caller must not hold a spinlock. The owner may
+// fault the page back in meanwhile, see swapRead(). If it takes the
+// frame back before the write starts, nobody needs the slot any more
+// and the write is skipped.
+void
+swapWrite(int idx) {
+  struct slot *s = &swap.slots[idx];
+  acquire(&swap.lock);
+  uint64 pa = s->cache;
+  release(&swap.lock);
+  if (pa != 0)
+    slotIO(idx, pa, 1);
+
+  acquire(&swap.lock);
+  pa = s->cache;
+  s->cache = 0;
+  s->writing = 0;
+  if (s->ref == 0)
+    swap.used -= 1; // Freed while being written.
+  if (pa != 0)
+    swap.pagesOut += 1;
+  release(&swap.lock);
+
+  if (pa != 0)
+    kfree((void *) pa);
+}
+
+// Add a swap PTE naming slot `idx`.
+void
+swapDup(int idx) {
+  acquire(&swap.lock);
+  swap.slots[idx].ref += 1;
+  release(&swap.lock);
+}
+
+// Drop a swap PTE naming slot `idx`, without reading the page.
+void
+swapFree(int idx) {
+  acquire(&swap.lock);
+  struct slot *s = &swap.slots[idx];
+  if (s->ref == 0)
+    panic("swapFree");
+  s->ref -= 1;
+  if (slotFree(s))
+    swap.used -= 1;
+  release(&swap.lock);
+}
+
+// Read the page of slot `idx` and drop the caller's swap PTE. `pa` is a
+// fresh frame for the page. Returns the frame holding the page, which
+// is the cached frame instead of `pa` if the page was still being
+// written out and nobody else shares it. Sleeps if the disk is read.
+uint64
+swapRead(int idx, uint64 pa) {
+  struct slot *s = &swap.slots[idx];
+
+  acquire(&swap.lock);
+  swap.pagesIn += 1;
+  if (s->cache != 0) {
+    if (s->ref == 1) {
+      pa = s->cache; // swapWrite() frees the slot when done.
+      s->cache = 0;
+    } else {
+      memmove((void *) pa, (void *) s->cache, PGSIZE);
+    }
+    s->ref -= 1;
+    release(&swap.lock);
+    return pa;
+  }
+  release(&swap.lock);
+
+  slotIO(idx, pa, 0); // Our reference keeps the slot from being reused.
+  swapFree(idx);
+  return pa;
+}
+
+// Swap usage, in pages. Any of the pointers may be 0.
+void
+swapStats(uint64 *used, uint64 *total, uint64 *pagesOut, uint64 *pagesIn) {
+  acquire(&swap.lock);
+  if (used)
+    *used = swap.used;
+  if (total)
+    *total = swap.nslots;
+  if (pagesOut)
+    *pagesOut = swap.pagesOut;
+  if (pagesIn)
+    *pagesIn = swap.pagesIn;
+  release(&swap.lock);
+}
@@ -106,6 +106,12 @@ extern uint64 sys_vm_promote(void);
 extern uint64 sys_vm_demote(void);
 extern uint64 sys_va2pa(void);
 extern uint64 sys_getsize(void);
+extern uint64 sys_vm_scanconfig(void);
+extern uint64 sys_vm_stats(void);
+extern uint64 sys_vm_limit(void);
+extern uint64 sys_vm_balloon(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_vm_share(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -136,6 +142,12 @@ static uint64 (*syscalls[])(void) = {
 [SYS_vm_demote]       = sys_vm_demote,
 [SYS_va2pa]           = sys_va2pa,
 [SYS_getsize]         = sys_getsize,
+[SYS_vm_scanconfig]   = sys_vm_scanconfig,
+[SYS_vm_stats]        = sys_vm_stats,
+[SYS_vm_limit]        = sys_vm_limit,
+[SYS_vm_balloon]      = sys_vm_balloon,
+[SYS_spawn]           = sys_spawn,
+[SYS_vm_share]        = sys_vm_share,
 };
 
 void
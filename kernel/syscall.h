@@ -25,3 +25,9 @@
 #define SYS_vm_demote        24
 #define SYS_va2pa            25
 #define SYS_getsize          26
+#define SYS_vm_scanconfig    27
+#define SYS_vm_stats         28
+#define SYS_vm_limit         29
+#define SYS_vm_balloon       30
+#define SYS_spawn            31
+#define SYS_vm_share         32
@@ -90,9 +90,11 @@ sys_uptime(void)
   return xticks;
 }
 
+// The CPU the calling process runs on. The scheduler keeps a process
+// on that CPU where it can, see makeRunnable() in proc.c.
 uint64
 sys_getcpu(void) {
-  return cpuid();
+  return myproc()->lastcpu;
 }
 
 uint64
@@ -106,7 +108,7 @@ sys_va2pa(void) {
   struct proc *p = myproc();
   uint64 pa = va2pa(p->pagetable, va);
 
-  if (shouldPrint == 1)
+  if (shouldPrint == 1 && pa != 0)
     printf("Data: %d\n", *(uint32 *) pa);
   return pa;
 }
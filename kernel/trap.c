@@ -16,6 +16,9 @@ void kernelvec();
 
 extern int devintr();
 
+// in start.c; timervec marks timer interrupts in it.
+extern uint64 timer_scratch[NCPU][7];
+
 void
 trapinit(void) {
   initlock(&tickslock, "time");
@@ -66,11 +69,13 @@ usertrap(void) {
      * */
     uint64 va = r_stval();
     pte_t *pte;
-    if ((va >= MAXVA) || (pte = walk(p->pagetable, va, 0)) == 0x0 ||
-        (*pte & PTE_U) == 0 || (*pte & PTE_V) == 0) { goto UNKNOWN; } // Trap cause unknown.
+    if ((va >= MAXVA) || (pte = walkLeaf(p->pagetable, va, 0)) == 0x0) { goto UNKNOWN; }
 
-    // Must handle COW Faults first and Demand Paging Faults later.
-    if ((PTE_FLAGS(*pte) & PTE_COW) != 0) { // Trap caused by COW.
+    if (PTE_SWAPPED(*pte)) { // Page was paged out. Read it back and retry the instruction.
+      if (handleSwapFault(p->pagetable, va) == -1) { goto UNKNOWN; }
+    } else if ((*pte & PTE_U) == 0 || (*pte & PTE_V) == 0) { // Trap cause unknown.
+      goto UNKNOWN;
+    } else if ((PTE_FLAGS(*pte) & PTE_COW) != 0) { // Trap caused by COW. Handled before Demand Paging.
       /* Let us consider the case when `READ` Page Fault happens when the PTE is marked `COW`.
        * The whole point of COW means that the process can read but not write. So, if the
        * parent process had access to a PA, then we will never end up here. If we do, then it
@@ -82,19 +87,12 @@ usertrap(void) {
     } else if (PTE2PA(*pte) == PRE_KERNEL_ADDRESS) { // Trap caused by Demand Paging.
       if (scause == 0xC) { goto UNKNOWN; }
 
-      /* The other case can be Page Fault due to Demand Paging. This is somewhat tricky and
-       * depends upon the choice of the kernel developer. Reaching here with a demand page
-       * fault means that the process is trying to read its memory location without ever
-       * writing it to it. Should this be allowed or not? Because, usually it is allowed with
-       * the memory read returning the default value for that data type. Even if we don't want
-       * to do that, this approach of demand paging creates a PTE that points to the
-       * `PRE_KERNEL_ADDRESS`, and this cannot be exposed to user process. Therefore, the below
-       * approach needs to mark unallocated demand pages as unreadable and immediately handle
-       * the first read to the location with an empty page allocation. It will handle read page
-       * fault for demand paging just like it handles the write case for demand paging,
-       * therefore, we are not introducing if condition over 0xF or 0xD.
+      /* The other case can be Page Fault due to Demand Paging. The page has never been
+       * touched, so its content is all zeros. A read maps it to the shared zero frame,
+       * marked COW, and only a later write gives it a frame of its own. A write allocates
+       * the frame right away.
        * */
-      if (handleDemandPageFault(p->pagetable, va) == -1) { goto UNKNOWN; }
+      if (handleDemandPageFault(p->pagetable, va, scause == 0xF) == -1) { goto UNKNOWN; }
     } else {
       goto UNKNOWN;
     }
@@ -182,7 +180,7 @@ kerneltrap() {
 
   // give up the CPU if this is a timer interrupt.
   if (which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
-    yield();
+    kyield();
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -230,17 +228,23 @@ devintr() {
 
     return 1;
   } else if (scause == 0x8000000000000001L) {
-    // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // software interrupt from a machine-mode timer interrupt
+    // or IPI, forwarded by timervec in kernelvec.S.
+
+    // acknowledge the software interrupt by clearing
+    // the SSIP bit in sip, before looking at the timer flag,
+    // so that a timer interrupt arriving meanwhile is not lost.
+    w_sip(r_sip() & ~2);
+
+    if (__sync_lock_test_and_set(&timer_scratch[cpuid()][6], 0) == 0) {
+      // an IPI from cpuwake() in proc.c, only to end wfi.
+      return 1;
+    }
 
     if (cpuid() == 0) {
       clockintr();
     }
 
-    // acknowledge the software interrupt by clearing
-    // the SSIP bit in sip.
-    w_sip(r_sip() & ~2);
-
     return 2;
   } else {
     return 0;
@@ -1,18 +1,23 @@
-#include <stdarg.h>
-
 #include "param.h"
 #include "types.h"
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
 #include "spinlock.h"
-#include "hashmap.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
 // The kernel's page table.
 pagetable_t kernel_pagetable;
-HASHMAP cowPageRefCount;
+
+// Number of user superpages currently mapped.
+uint64 superpages;
+
+// Frame of zeros shared COW by every page that is only ever read, or
+// that the merge scanner found to be all zero. It holds a reference of
+// its own, so it is never freed.
+uint64 zeroFrame;
 
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
@@ -32,6 +37,9 @@ kvmmake(void) {
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, for waking up other harts (see cpuwake() in proc.c)
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
@@ -54,8 +62,18 @@ kvmmake(void) {
 // Initialize the one kernel_pagetable
 void
 kvminit(void) {
-  init_hashmap(&cowPageRefCount);
   kernel_pagetable = kvmmake();
+
+  if ((zeroFrame = (uint64) kalloc()) == 0)
+    panic("kvminit: zero frame");
+  memset((void *) zeroFrame, 0, PGSIZE);
+  frameRefIncrement(zeroFrame);
+  frameSetFlags(zeroFrame, FRAME_ZERO);
+}
+
+uint64
+getZeroFrame() {
+  return zeroFrame;
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -113,6 +131,9 @@ freewalk(pagetable_t pagetable) {
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A superpage on the way to va is split into 4 KiB pages first.
+// Returns 0 if that needs memory which cannot be allocated.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc) {
   if (va >= MAXVA)
@@ -120,7 +141,12 @@ walk(pagetable_t pagetable, uint64 va, int alloc) {
 
   for (int level = 2; level > 0; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
-    if (*pte & PTE_V) {
+    if ((*pte & PTE_V) && PTE_LEAF(*pte)) {
+      if (level != 1)
+        panic("walk: gigapage");
+      if ((pagetable = splitSuperpage(pte)) == 0x0)
+        return 0;
+    } else if (*pte & PTE_V) {
       pagetable = (pagetable_t) PTE2PA(*pte);
     } else {
       if (!alloc || (pagetable = (pde_t *) kalloc()) == 0) {
@@ -135,17 +161,95 @@ walk(pagetable_t pagetable, uint64 va, int alloc) {
   return &pagetable[PX(0, va)];
 }
 
+// Like walk(), but never allocates and never splits a superpage.
+// Returns the leaf PTE mapping va, which may be a level-1 superpage
+// PTE, and stores its level in *level if level is not 0.
+// Returns 0 if a page-table page on the way is missing.
+pte_t *
+walkLeaf(pagetable_t pagetable, uint64 va, int *level) {
+  if (va >= MAXVA)
+    panic("walkLeaf");
+
+  for (int l = 2; l > 0; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
+    if ((*pte & PTE_V) == 0)
+      return 0;
+    if (PTE_LEAF(*pte)) {
+      if (level)
+        *level = l;
+      return pte;
+    }
+    pagetable = (pagetable_t) PTE2PA(*pte);
+  }
+  if (level)
+    *level = 0;
+  return &pagetable[PX(0, va)];
+}
+
+// Replace the superpage PTE *pte with a page-table page that maps the
+// same memory with 512 4 KiB PTEs. Returns the new page-table page,
+// or 0 if out of memory.
+pagetable_t
+splitSuperpage(pte_t *pte) {
+  pagetable_t pagetable;
+  if ((pagetable = (pagetable_t) kalloc()) == 0x0)
+    return 0x0;
+
+  uint64 pa = PTE2PA(*pte);
+  uint64 flags = PTE_FLAGS(*pte);
+  for (int i = 0; i < 512; i++)
+    pagetable[i] = PA2PTE(pa + i * PGSIZE) | flags;
+  *pte = PA2PTE(pagetable) | PTE_V;
+  __atomic_sub_fetch(&superpages, 1, __ATOMIC_RELAXED);
+  return pagetable;
+}
+
+// Map the 2 MiB block at pa to the superpage-aligned va with a single
+// level-1 PTE. An empty page-table page left at that slot is freed.
+// Returns 0 on success, -1 if the slot is in use or out of memory.
+static int
+mapSuperpage(pagetable_t pagetable, uint64 va, uint64 pa, int perm) {
+  pte_t *pte = &pagetable[PX(2, va)];
+  if ((*pte & PTE_V) == 0) {
+    pagetable_t l1;
+    if ((l1 = (pagetable_t) kalloc()) == 0x0)
+      return -1;
+    memset(l1, 0, PGSIZE);
+    *pte = PA2PTE(l1) | PTE_V;
+  }
+  pte = &((pagetable_t) PTE2PA(*pte))[PX(1, va)];
+
+  if ((*pte & PTE_V) && PTE_LEAF(*pte))
+    panic("mapSuperpage: remap");
+  if (*pte & PTE_V) {
+    pagetable_t l0 = (pagetable_t) PTE2PA(*pte);
+    for (int i = 0; i < 512; i++)
+      if (l0[i] != 0) // Mapped or paged out.
+        return -1;
+    kfree((void *) l0);
+  }
+  *pte = PA2PTE(pa) | perm | PTE_V;
+  __atomic_add_fetch(&superpages, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+uint64
+getSuperpageCount() {
+  return __atomic_load_n(&superpages, __ATOMIC_RELAXED);
+}
+
 // Look up a virtual address, return the physical address, or 0 if not mapped.
 // Can only be used to look up user pages.
 uint64
 walkaddr(pagetable_t pagetable, uint64 va) {
   pte_t *pte;
   uint64 pa;
+  int level;
 
   if (va >= MAXVA)
     return 0;
 
-  pte = walk(pagetable, va, 0);
+  pte = walkLeaf(pagetable, va, &level);
   if (pte == 0)
     return 0;
   if ((*pte & PTE_V) == 0)
@@ -153,13 +257,17 @@ walkaddr(pagetable_t pagetable, uint64 va) {
   if ((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if (level == 1)
+    pa += PGROUNDDOWN(va) % SUPERPGSIZE;
   return pa;
 }
 
+// Physical address of the byte at va, or 0 if va is not mapped
+// or its page has not been allocated yet.
 uint64
 va2pa(pagetable_t pagetable, uint64 va) {
   uint64 baseAddr = walkaddr(pagetable, va);
-  if (baseAddr == 0x0) return 0x0;
+  if (baseAddr == 0x0 || baseAddr == PRE_KERNEL_ADDRESS) return 0x0;
   else return baseAddr + (va - PGROUNDDOWN(va));
 }
 
@@ -170,36 +278,140 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm) {
     panic("kvmmap");
 }
 
-void **refIncrement(uint8 exists, uint64 pa, void *oldCount, va_list params) {
-  (void) (pa);
-  (void) (params);
+// The process using `pagetable`, if it is the current process.
+// Resident pages are only charged here for the current process.
+// The VMM adjusts the counts of the VMs whose pages it remaps.
+static struct proc *
+owner(pagetable_t pagetable) {
+  struct proc *p = myproc();
+  return (p != 0x0 && p->pagetable == pagetable) ? p : 0x0;
+}
+
+// Whether a mapping of the frame `pa` is charged to the process that
+// maps it. Every frame is, except the zero frame and the stable frames
+// of the scanner, which belong to no one. A frame shared COW by fork()
+// is charged to each process mapping it, so that a VM can't get from
+// under its limit by forking a child that exits again.
+int
+frameCharged(uint64 pa) {
+  return pa != PRE_KERNEL_ADDRESS && pa != zeroFrame && (frameFlags(pa) & FRAME_KSM) == 0;
+}
+
+// Charge `npages` frames to the owner of `pagetable`, ignoring its limit.
+static void
+rssAdd(pagetable_t pagetable, uint64 npages) {
+  struct proc *p = owner(pagetable);
+  if (p != 0x0)
+    __atomic_add_fetch(&p->rss, npages, __ATOMIC_RELAXED);
+}
 
-  void **res = (void **) kalloc();
+// Whether the caller may sleep, that is, holds no spinlock.
+static int
+canSleep() {
+  push_off();
+  int ok = (mycpu()->noff == 1 && myproc() != 0x0);
+  pop_off();
+  return ok;
+}
 
-  uint64 newCount = 0;
-  if (exists) { newCount = (uint64) oldCount; }
-  newCount += 1;
+// Charge `npages` new frames to the owner of `pagetable`.
+// Returns -1, charging nothing, if that would exceed its limit.
+static int
+rssTryCharge(pagetable_t pagetable, uint64 npages) {
+  struct proc *p = owner(pagetable);
+  if (p == 0x0)
+    return 0;
+  if (p->rssLimit != 0 && p->rss + npages > p->rssLimit)
+    return -1;
+  __atomic_add_fetch(&p->rss, npages, __ATOMIC_RELAXED);
+  return 0;
+}
 
-  res[0] = (void *) newCount;
-  res[1] = (void *) ((uint64) 0);
-  return res;
+// Like rssTryCharge(), but an owner at its limit first pages out some
+// of its own cold pages to make room, unless the caller holds a spinlock.
+static int
+rssCharge(pagetable_t pagetable, uint64 npages) {
+  if (rssTryCharge(pagetable, npages) == 0)
+    return 0;
+  struct proc *p = owner(pagetable);
+  if (!canSleep())
+    return -1;
+  // Read once, the scanner may uncharge pages meanwhile.
+  uint64 want = p->rss + npages;
+  uint64 excess = want > p->rssLimit ? want - p->rssLimit : 0;
+  reclaimOwnPages(excess < SWAPBATCH ? SWAPBATCH : (int) excess);
+  return rssTryCharge(pagetable, npages);
 }
 
-void **refDecrement(uint8 exists, uint64 pa, void *oldCount, va_list params) {
-  if (exists == 0 || (uint64) oldCount == 0) { panic("Decrementing 0 ref count...\n"); }
+static void
+rssUncharge(pagetable_t pagetable, uint64 npages) {
+  struct proc *p = owner(pagetable);
+  if (p != 0x0)
+    __atomic_sub_fetch(&p->rss, npages, __ATOMIC_RELAXED);
+}
 
-  void **res = (void **) kalloc();
+// kalloc() a frame for a user page. When memory runs out, cold pages
+// of the VMs are paged out to make room, unless the caller holds a
+// spinlock and can't wait for the disk.
+static void *
+kallocUser() {
+  void *mem = kalloc();
+  if (mem == 0x0 && canSleep() && reclaimPages(SWAPBATCH) > 0)
+    mem = kalloc();
+  return mem;
+}
 
-  uint64 newCount = ((uint64) oldCount) - 1;
-  int do_free = va_arg(params, int);
+// Number of frames mapped in [0, sz) that are charged to the
+// process, see frameCharged().
+uint64
+uvmrss(pagetable_t pagetable, uint64 sz) {
+  uint64 n = 0;
+  for (uint64 va = 0; va < sz; va += PGSIZE) {
+    int level;
+    pte_t *pte = walkLeaf(pagetable, va, &level);
+    if (pte == 0x0 || (*pte & PTE_V) == 0)
+      continue;
+    if (level != 0) {
+      n += SUPERPGSIZE / PGSIZE;
+      va += SUPERPGSIZE - PGSIZE;
+    } else if (frameCharged(PTE2PA(*pte))) {
+      n += 1;
+    }
+  }
+  return n;
+}
 
-  if (newCount == 0 && do_free == 1) {
+// Take one more reference to the COW page `pa`.
+void
+cowRefIncrement(uint64 pa) {
+  frameRefIncrement(pa);
+}
+
+// Drop one reference to the COW page `pa`, freeing it
+// when the last reference goes away and `do_free` is set.
+void
+cowRefDecrement(uint64 pa, int do_free) {
+  if (frameRefDecrement(pa) == 0 && do_free == 1) {
     kfree((void *) pa);
   }
+}
+
+// Number of references held to the COW page `pa`.
+uint64
+cowRefCount(uint64 pa) {
+  return frameRefCount(pa);
+}
 
-  res[0] = (void *) newCount;
-  res[1] = (void *) ((uint64) (newCount == 0));
-  return res;
+// Returns `flags` with write access revoked and the page marked COW.
+// The original write permission is remembered in `PTE_OLD_W`.
+uint64
+cowFlags(uint64 flags) {
+  if ((flags & PTE_COW) == 0) {
+    if ((flags & PTE_W) != 0) { flags |= PTE_OLD_W; } else { flags &= (~PTE_OLD_W); }
+  }
+  flags &= (~PTE_W);
+  flags |= PTE_COW;
+  return flags;
 }
 
 /**
@@ -233,7 +445,7 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm) {
     *pte = PA2PTE(pa) | perm | PTE_V;
     pa = PTE2PA(*pte);
     if ((pa != PRE_KERNEL_ADDRESS) && ((PTE_FLAGS(*pte) & PTE_COW) != 0)) {
-      hashmap_update(&cowPageRefCount, pa, refIncrement);
+      cowRefIncrement(pa);
     }
 
     currVA += PGSIZE;
@@ -242,17 +454,51 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm) {
   return 0;
 }
 
+// Split the superpage mapping `va`, unless `va` is where it starts, so
+// that the pages from `va` on can be unmapped on their own.
+// Returns 0 on success, -1 if out of memory.
+static int
+splitAt(pagetable_t pagetable, uint64 va) {
+  int level;
+  pte_t *pte = walkLeaf(pagetable, va, &level);
+  if (pte == 0x0 || level != 1 || (va % SUPERPGSIZE) == 0)
+    return 0;
+  return (splitSuperpage(pte) == 0x0) ? -1 : 0;
+}
+
 // Remove `npages` of mappings starting from va. va must be page-aligned.
 // The mappings must exist. Optionally free the physical memory.
+// A superpage must be unmapped whole, or split first with splitAt(),
+// since splitting needs memory and this can't fail.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free) {
   if ((va % PGSIZE) != 0)
     panic("uvmunmap: not aligned");
 
   pte_t *pte;
-  for (uint64 a = va; a < va + npages * PGSIZE; a += PGSIZE) {
-    if ((pte = walk(pagetable, a, 0)) == 0)
+  int level;
+  uint64 end = va + npages * PGSIZE;
+  for (uint64 a = va; a < end; a += PGSIZE) {
+    if ((pte = walkLeaf(pagetable, a, &level)) != 0 && level == 1) {
+      if ((a % SUPERPGSIZE) == 0 && a + SUPERPGSIZE <= end) {
+        // Whole superpage. Superpages are never COW.
+        if (do_free)
+          kfreeOrder((void *) PTE2PA(*pte), SUPERPGORDER);
+        rssUncharge(pagetable, SUPERPGSIZE / PGSIZE);
+        *pte = 0;
+        __atomic_sub_fetch(&superpages, 1, __ATOMIC_RELAXED);
+        a += SUPERPGSIZE - PGSIZE;
+        continue;
+      }
+      panic("uvmunmap: partial superpage");
+    }
+    if (pte == 0)
       panic("uvmunmap: walk");
+    if (PTE_SWAPPED(*pte)) {
+      swapFree(PTE2SLOT(*pte));
+      *pte = 0;
+      continue;
+    }
     if ((*pte & PTE_V) == 0)
       panic("uvmunmap: not mapped");
     if (PTE_FLAGS(*pte) == PTE_V)
@@ -260,8 +506,10 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free) {
 
     uint64 pa;
     if ((pa = PTE2PA(*pte)) != PRE_KERNEL_ADDRESS) {
+      if (frameCharged(pa))
+        rssUncharge(pagetable, 1);
       if ((PTE_FLAGS(*pte) & PTE_COW) != 0) {
-        hashmap_update(&cowPageRefCount, pa, refDecrement, do_free);
+        cowRefDecrement(pa, do_free);
       } else if (do_free) {
         kfree((void *) pa);
       }
@@ -286,6 +534,7 @@ uvmfirst(pagetable_t pagetable, uchar *src, uint sz) {
 
 // Allocate PTEs and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
+// Aligned 2 MiB stretches are mapped with superpages when possible.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm) {
   char *mem;
@@ -296,13 +545,32 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm) {
 
   oldsz = PGROUNDUP(oldsz);
   for (a = oldsz; a < newsz; a += PGSIZE) {
-    if ((mem = kalloc()) == 0x0) {
+    if ((a % SUPERPGSIZE) == 0 && a + SUPERPGSIZE <= newsz &&
+        rssTryCharge(pagetable, SUPERPGSIZE / PGSIZE) == 0) {
+      if ((mem = kallocOrder(SUPERPGORDER)) != 0x0) {
+        memset(mem, 0, SUPERPGSIZE);
+        if (mapSuperpage(pagetable, a, (uint64) mem, PTE_R | PTE_U | xperm) == 0) {
+          a += SUPERPGSIZE - PGSIZE;
+          continue;
+        }
+        kfreeOrder(mem, SUPERPGORDER);
+      }
+      rssUncharge(pagetable, SUPERPGSIZE / PGSIZE); // Fall back to 4 KiB pages.
+    }
+
+    if (rssCharge(pagetable, 1) != 0) {
+      uvmdealloc(pagetable, a, oldsz);
+      return 0;
+    }
+    if ((mem = kallocUser()) == 0x0) {
+      rssUncharge(pagetable, 1);
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
     memset(mem, 0, PGSIZE);
     if (mappages(pagetable, a, PGSIZE, (uint64) mem, PTE_R | PTE_U | xperm) != 0) {
       kfree(mem);
+      rssUncharge(pagetable, 1);
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
@@ -313,13 +581,16 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm) {
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
+// process size.  Returns the new process size, or oldsz if a
+// superpage across newsz could not be split for lack of memory.
 uint64
 uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz) {
   if (newsz >= oldsz)
     return oldsz;
 
   if (PGROUNDUP(newsz) < PGROUNDUP(oldsz)) {
+    if (splitAt(pagetable, PGROUNDUP(newsz)) != 0)
+      return oldsz;
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
     uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
   }
@@ -338,35 +609,70 @@ uvmfree(pagetable_t pagetable, uint64 sz) {
 int
 cowMapOrCopyPages(pagetable_t old, pagetable_t new, uint64 va, uint cow) {
   pte_t *pte;
-  if ((pte = walk(old, va, 0)) == 0) { panic("cowMapOrCopyPages: pte should exist"); }
+  if ((pte = walk(old, va, 0)) == 0) { return -1; } // Out of memory splitting a superpage.
+  if (PTE_SWAPPED(*pte)) {
+    // Paged out, the child shares the swap slot.
+    pte_t *childPTE;
+    if ((childPTE = walk(new, va, 1)) == 0) { return -1; }
+    swapDup(PTE2SLOT(*pte));
+    *childPTE = *pte;
+    return 0;
+  }
   if ((*pte & PTE_V) == 0) { panic("cowMapOrCopyPages: page not present"); }
 
   uint64 oldPA = PTE2PA(*pte);
   uint flags = PTE_FLAGS(*pte);
 
-  uint64 newPA;
+  if (oldPA == PRE_KERNEL_ADDRESS || oldPA == zeroFrame) {
+    // Not written yet, the child shares the lazy or zero page.
+    return mappages(new, va, PGSIZE, oldPA, (int) flags);
+  }
+
   if (cow == 0) {
+    uint64 newPA;
     if ((newPA = (uint64) kalloc()) == 0x0) { return -1; }
-    if (oldPA != PRE_KERNEL_ADDRESS) {
-      memmove((char *) newPA, (char *) oldPA, PGSIZE);
+    pageCopy(newPA, oldPA);
+
+    // A copied page is private to the child, even if the parent's is COW.
+    if ((flags & PTE_COW) != 0) {
+      if ((flags & PTE_OLD_W) != 0) { flags |= PTE_W; }
+      flags &= ~(PTE_COW | PTE_OLD_W);
     }
-  } else if (cow == 1) {
-    if (oldPA != PRE_KERNEL_ADDRESS) {
-      if ((flags & PTE_COW) == 0) {
-        if ((flags & PTE_W) != 0) { flags |= PTE_OLD_W; } else { flags &= (~PTE_OLD_W); }
-      }
-      flags &= (~PTE_W);
-      flags |= PTE_COW;
+    if (mappages(new, va, PGSIZE, newPA, (int) flags) != 0) {
+      kfree((void *) newPA);
+      return -1;
     }
-    newPA = oldPA;
-  } else { return -1; }
-
-  // If `cow == 0`, parent's PTE is unmapped and remapped w/o changes.
-  // If `cow == 1`, parent's PTE is unmapped and remapped with new flags.
-  uvmunmap(old, va, 1, 0);
-  if ((mappages(old, va, PGSIZE, oldPA, flags) != 0) ||
-      (mappages(new, va, PGSIZE, newPA, flags) != 0)) {
-    if (cow == 0) { kfree((void *) newPA); }
+    return 0;
+  }
+
+  // Both share the frame read-only. The child is mapped first, so that
+  // the parent's PTE is left as it was if that fails.
+  uint cowPerm = cowFlags(flags);
+  if (mappages(new, va, PGSIZE, oldPA, (int) cowPerm) != 0) { return -1; }
+  if ((flags & PTE_COW) == 0) {
+    cowRefIncrement(oldPA);
+    *pte = PA2PTE(oldPA) | cowPerm; // The parent's stale TLB entries go on its return to user space.
+  }
+  return 0;
+}
+
+// Copy the superpage mapped at `va` in `old` into a new superpage in `new`.
+// Returns 0 on success, -1 if `va` does not start a superpage or
+// no 2 MiB block is free.
+static int
+copySuperpage(pagetable_t old, pagetable_t new, uint64 va) {
+  pte_t *pte;
+  int level;
+  if ((va % SUPERPGSIZE) != 0 || (pte = walkLeaf(old, va, &level)) == 0 || level != 1)
+    return -1;
+
+  char *mem;
+  if ((mem = kallocOrder(SUPERPGORDER)) == 0x0)
+    return -1;
+  for (int i = 0; i < 512; i++)
+    pageCopy((uint64) mem + i * PGSIZE, PTE2PA(*pte) + i * PGSIZE);
+  if (mapSuperpage(new, va, (uint64) mem, (int) (PTE_FLAGS(*pte) & ~PTE_V)) != 0) {
+    kfreeOrder(mem, SUPERPGORDER);
     return -1;
   }
   return 0;
@@ -374,6 +680,9 @@ cowMapOrCopyPages(pagetable_t old, pagetable_t new, uint64 va, uint cow) {
 
 // Given a parent process's page table, copy its memory into a child's page table.
 // Copies the page table. If `cow == 0`, then also copies the physical memory.
+// Superpages are copied whole if `cow == 0`, and split into pages otherwise.
+// Only the leaf PTEs are shared when `cow == 1`, page-table pages are
+// always copied.
 // Returns -1 on failure after freeing any allocated pages, else returns 0 on success.
 int
 uvmcopy(pagetable_t old, pagetable_t new, uint64 sz, uint cow) {
@@ -381,6 +690,10 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz, uint cow) {
 
   int res;
   for (currVA = 0; currVA < sz; currVA += PGSIZE) {
+    if (cow == 0 && currVA + SUPERPGSIZE <= sz && copySuperpage(old, new, currVA) == 0) {
+      currVA += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
     if ((res = cowMapOrCopyPages(old, new, currVA, cow)) < 0) {
       if (res == -1) { uvmunmap(new, 0, currVA / PGSIZE, 1); }
       return -1;
@@ -391,14 +704,31 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz, uint cow) {
 
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
-void
+// Returns 0 on success, -1 if out of memory splitting a superpage.
+int
 uvmclear(pagetable_t pagetable, uint64 va) {
   pte_t *pte;
 
   pte = walk(pagetable, va, 0);
   if (pte == 0)
-    panic("uvmclear");
+    return -1;
   *pte &= ~PTE_U;
+  return 0;
+}
+
+// Look up the user page at va like walkaddr(), for reading. A page
+// that has not been touched yet is mapped to the zero frame first.
+// Returns 0 if va is not mapped or memory is exhausted.
+static uint64
+walkaddrFault(pagetable_t pagetable, uint64 va) {
+  uint64 pa = walkaddr(pagetable, va);
+  if (pa == 0 && handleSwapFault(pagetable, va) == 0)
+    pa = walkaddr(pagetable, va);
+  if (pa == PRE_KERNEL_ADDRESS) {
+    if (handleDemandPageFault(pagetable, va, 0) != 0) { return 0; }
+    pa = walkaddr(pagetable, va);
+  }
+  return pa;
 }
 
 // Copy from kernel to user.
@@ -412,18 +742,23 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len) {
   while (len > 0) {
     baseVA = PGROUNDDOWN(dstva);
     basePA = walkaddr(pagetable, baseVA);
+    if (basePA == 0 && handleSwapFault(pagetable, baseVA) == 0) {
+      basePA = walkaddr(pagetable, baseVA);
+    }
     if (basePA == 0) { return -1; }
 
     n = PGSIZE - (dstva - baseVA);
     if (n > len) { n = len; }
 
-    pte = walk(pagetable, baseVA, 0);
+    pte = walkLeaf(pagetable, baseVA, 0);
     if ((*pte & PTE_COW) != 0) {
-      handleCOWPageFault(pagetable, baseVA);
+      if (handleCOWPageFault(pagetable, baseVA) != 0) { return -1; }
     } else if (basePA == PRE_KERNEL_ADDRESS) {
-      handleDemandPageFault(pagetable, baseVA);
+      if (handleDemandPageFault(pagetable, baseVA, 1) != 0) { return -1; }
     }
 
+    pte = walkLeaf(pagetable, baseVA, 0);
+    if ((*pte & PTE_W) == 0) { return -1; }
     basePA = walkaddr(pagetable, baseVA);
     memmove((void *) (basePA + (dstva - baseVA)), src, n);
 
@@ -443,16 +778,12 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len) {
 
   while (len > 0) {
     baseVA = PGROUNDDOWN(srcva);
-    basePA = walkaddr(pagetable, baseVA);
+    basePA = walkaddrFault(pagetable, baseVA);
     if (basePA == 0) { return -1; }
 
     n = PGSIZE - (srcva - baseVA);
     if (n > len) { n = len; }
 
-    if (basePA == PRE_KERNEL_ADDRESS) {
-      handleDemandPageFault(pagetable, baseVA);
-      basePA = walkaddr(pagetable, baseVA);
-    }
     memmove(dst, (void *) (basePA + (srcva - baseVA)), n);
 
     len -= n;
@@ -473,17 +804,12 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max) {
 
   while (got_null == 0 && max > 0) {
     baseVA = PGROUNDDOWN(srcva);
-    basePA = walkaddr(pagetable, baseVA);
+    basePA = walkaddrFault(pagetable, baseVA);
     if (basePA == 0) { return -1; }
 
     n = PGSIZE - (srcva - baseVA);
     if (n > max) { n = max; }
 
-    if (basePA == PRE_KERNEL_ADDRESS) {
-      handleDemandPageFault(pagetable, baseVA);
-      basePA = walkaddr(pagetable, baseVA);
-    }
-
     char *p = (char *) (basePA + (srcva - baseVA));
     while (n > 0) {
       if (*p == '\0') {
@@ -508,8 +834,13 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max) {
   }
 }
 
-// See `int growproc(int);` in `proc.c`. Search `demand_alloc` to see
-// how to enable the usage of this function.
+// Reserve the user pages in [oldsz, newsz) without allocating memory.
+// Each page is mapped to PRE_KERNEL_ADDRESS with only PTE_U set, so the
+// first access faults and handleDemandPageFault() allocates the frame.
+// Aligned 2 MiB stretches are the exception: a heap grown by that much
+// is meant to be used, so they are mapped with zeroed superpages right
+// away when a block is free and the owner's limit allows it.
+// Returns the new size or 0 on error.
 uint64
 demand_alloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz) {
   if (newsz < oldsz)
@@ -517,6 +848,19 @@ demand_alloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz) {
   oldsz = PGROUNDUP(oldsz);
 
   for (uint64 currsz = oldsz; currsz < newsz; currsz += PGSIZE) {
+    if ((currsz % SUPERPGSIZE) == 0 && currsz + SUPERPGSIZE <= newsz &&
+        rssTryCharge(pagetable, SUPERPGSIZE / PGSIZE) == 0) {
+      char *mem;
+      if ((mem = kallocOrder(SUPERPGORDER)) != 0x0) {
+        memset(mem, 0, SUPERPGSIZE);
+        if (mapSuperpage(pagetable, currsz, (uint64) mem, PTE_R | PTE_W | PTE_U) == 0) {
+          currsz += SUPERPGSIZE - PGSIZE;
+          continue;
+        }
+        kfreeOrder(mem, SUPERPGORDER);
+      }
+      rssUncharge(pagetable, SUPERPGSIZE / PGSIZE); // Reserve 4 KiB pages instead.
+    }
     if (mappages(pagetable, currsz, PGSIZE, PRE_KERNEL_ADDRESS, PTE_U) != 0) {
       uvmdealloc(pagetable, currsz, oldsz);
       return 0;
@@ -526,43 +870,127 @@ demand_alloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz) {
   return newsz;
 }
 
-int handleDemandPageFault(pagetable_t pagetable, uint64 va) {
-  // BUG: There is a bug due to which not all user test cases pass.
-  if ((PTE_FLAGS(*walk(pagetable, va, 0)) & PTE_COW) != 0) {
-    panic("Page is marked COW. Can't handle it for demand paging fault.");
+// Back the lazy page at `va`. A read maps it COW to the zero frame.
+// A write allocates a zeroed frame. Lazy pages are never promoted to
+// superpages, so touching one page costs one frame.
+// Returns 0 on success, -1 if `va` is not a lazy page or out of memory.
+int
+handleDemandPageFault(pagetable_t pagetable, uint64 va, int write) {
+  va = PGROUNDDOWN(va);
+  pte_t *pte = walkLeaf(pagetable, va, 0);
+  if (pte == 0x0 || (*pte & PTE_V) == 0 || PTE2PA(*pte) != PRE_KERNEL_ADDRESS) { return -1; }
+
+  if (write == 0) {
+    uvmunmap(pagetable, va, 1, 0);
+    if (mappages(pagetable, va, PGSIZE, zeroFrame, (int) cowFlags(PTE_R | PTE_W | PTE_U)) != 0) {
+      mappages(pagetable, va, PGSIZE, PRE_KERNEL_ADDRESS, PTE_U); // Cannot fail, the PTE exists.
+      return -1;
+    }
+    return 0;
   }
 
-  if (walkaddr(pagetable, va) != PRE_KERNEL_ADDRESS) { return -1; }
+  if (rssCharge(pagetable, 1) != 0) { return -1; }
+  char *mem;
+  if ((mem = kallocUser()) == 0x0) {
+    rssUncharge(pagetable, 1);
+    return -1;
+  }
+  memset(mem, 0, PGSIZE);
 
-  va = PGROUNDDOWN(va);
   uvmunmap(pagetable, va, 1, 0);
-  if (uvmalloc(pagetable, va, va + PGSIZE, PTE_W) == 0) {
+  if (mappages(pagetable, va, PGSIZE, (uint64) mem, PTE_R | PTE_W | PTE_U) != 0) {
+    kfree(mem);
+    rssUncharge(pagetable, 1);
     return -1;
   }
   return 0;
 }
 
+// Give `va` a writable page of its own after a write to its COW mapping.
+// The last mapping of a frame takes the frame over, any other one gets
+// a copy. Returns 0 on success, -1 if the page was never writable or
+// out of memory.
 int
 handleCOWPageFault(pagetable_t pagetable, uint64 va) {
-  // BUG: Analyse why there is free list size drop when using COW forking.
+  va = PGROUNDDOWN(va);
   pte_t *pte = walk(pagetable, va, 0);
-  uint64 flags = PTE_FLAGS(*pte);
-  if ((flags & PTE_COW) == 0) { return -1; }
+  if (pte == 0 || (*pte & PTE_COW) == 0) { return -1; }
+  if ((*pte & PTE_OLD_W) == 0) { return -1; } // Read-only before it was shared.
 
   uint64 pa = PTE2PA(*pte);
+  if (pa != zeroFrame && cowRefCount(pa) == 1) {
+    // Nobody else maps the frame, which is charged to us already. Only
+    // this process could add a mapping now, since the scanner keeps its
+    // own reference to merged frames.
+    cowRefDecrement(pa, 0);
+    *pte = (*pte | PTE_W) & ~(PTE_COW | PTE_OLD_W);
+    return 0;
+  }
+
+  // The copy is charged. A frame shared by fork() was charged too, and
+  // unmapping it below uncharges it again, so only a copy of the zero
+  // frame or of a merged frame has to fit under the limit.
+  if (frameCharged(pa)) {
+    rssAdd(pagetable, 1);
+  } else if (rssCharge(pagetable, 1) != 0) {
+    return -1;
+  }
+
   uint64 newPage;
-  if ((newPage = (uint64) kalloc()) == 0x0) { return -1; }
-  if (pa != PRE_KERNEL_ADDRESS) { memmove((char *) newPage, (char *) pa, PGSIZE); }
+  if ((newPage = (uint64) kallocUser()) == 0x0) {
+    rssUncharge(pagetable, 1);
+    return -1;
+  }
 
-  if ((flags & PTE_OLD_W) != 0) { flags |= PTE_W; }
-  flags &= (~PTE_OLD_W);
+  // Read the PTE again, the scanner may have remapped the page
+  // while kallocUser() was waiting for the disk.
+  uint64 flags = (PTE_FLAGS(*pte) | PTE_W) & ~(PTE_COW | PTE_OLD_W);
+  pa = PTE2PA(*pte);
 
-  va = PGROUNDDOWN(va);
-  uvmunmap(pagetable, va, 1, 0);
-  if (mappages(pagetable, va, PGSIZE, newPage, (int) (flags & (~PTE_COW))) != 0) {
+  struct proc *p = myproc();
+  if (p != 0x0 && p->pagetable == pagetable && (pa == zeroFrame || (frameFlags(pa) & FRAME_KSM) != 0))
+    __atomic_add_fetch(&p->pagesUnmerged, 1, __ATOMIC_RELAXED);
+  if (pa == zeroFrame) {
+    memset((void *) newPage, 0, PGSIZE);
+  } else {
+    pageCopy(newPage, pa);
+  }
+
+  // The old page has already been copied, so drop this mapping's
+  // reference to it and let the last one free it.
+  uvmunmap(pagetable, va, 1, 1);
+  if (mappages(pagetable, va, PGSIZE, newPage, (int) flags) != 0) {
     kfree((void *) newPage);
+    rssUncharge(pagetable, 1);
     return -1;
   }
 
   return 0;
 }
+
+// Bring back the paged out page at `va`. The caller must not hold a
+// spinlock, as the page may have to be read from the disk.
+// Returns 0 on success, -1 if `va` is not paged out or out of memory.
+int
+handleSwapFault(pagetable_t pagetable, uint64 va) {
+  va = PGROUNDDOWN(va);
+  pte_t *pte = walkLeaf(pagetable, va, 0);
+  if (pte == 0x0 || !PTE_SWAPPED(*pte) || !canSleep()) { return -1; }
+
+  if (rssCharge(pagetable, 1) != 0) { return -1; }
+  uint64 mem;
+  if ((mem = (uint64) kallocUser()) == 0x0) {
+    rssUncharge(pagetable, 1);
+    return -1;
+  }
+
+  // Only the owner of a page table maps or unmaps its paged out pages,
+  // so the PTE can't change while swapRead() sleeps.
+  pte_t swapPTE = *pte;
+  uint64 pa = swapRead(PTE2SLOT(swapPTE), mem);
+  if (pa != mem) { kfree((void *) mem); }
+
+  uint64 flags = PTE_FLAGS(swapPTE) & ~(PTE_SWAP | PTE_A | PTE_D);
+  *pte = PA2PTE(pa) | flags | PTE_V;
+  return 0;
+}
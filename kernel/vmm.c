@@ -1,40 +1,619 @@
 #include "types.h"
 #include "param.h"
+#include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "hashmap.h"
 #include "proc.h"
 #include "vmm.h"
+#include "vmmstat.h"
 #include "defs.h"
 
 static VMM_STATE vmmState;
+static struct spinlock collectLock; // Serializes `collectVMs()`.
 
-uint getCurrTime() {
-  acquire(&tickslock);
-  uint currTicks = ticks;
-  release(&tickslock);
-  return currTicks;
-}
+void vmmScanner(void);
+
+// Clock hand of the page-out reclaimer. Held while it moves, which
+// includes waiting for the disk.
+static struct {
+    struct sleeplock lock;
+    int pid;     // VM the hand is on
+    uint64 va;
+} hand;
 
 void vmmInit() {
-  initlock(&vmmState.samplingTimeLock, "VMM Mem sampling time lock");
+  initlock(&vmmState.lock, "VMM scanner config lock");
+  initlock(&collectLock, "VMM collect lock");
+  initsleeplock(&hand.lock, "VMM reclaim hand");
   init_hashmap(&vmmState.registeredVMs);
   init_pageHashmap(&vmmState.knownPages);
-  acquire(&vmmState.samplingTimeLock);
-  vmmState.lastSamplingTime = getCurrTime();
-  release(&vmmState.samplingTimeLock);
+  init_pageHashmap(&vmmState.unstablePages);
+  acquire(&vmmState.lock);
+  vmmState.scanBudget = VMMSCANPAGES;
+  vmmState.scanRate = VMMSCANRATE;
+  release(&vmmState.lock);
+
+  if (kthread(vmmScanner, "vmmscan") < 0)
+    panic("vmmInit: kthread");
+}
+
+void sleepTicks(uint64 n) {
+  acquire(&tickslock);
+  uint ticks0 = ticks;
+  while (ticks - ticks0 < n)
+    sleep(&ticks, &tickslock);
+  release(&tickslock);
+}
+
+// Snapshot of the registered VMs.
+struct vmList {
+    int count;
+    int pids[NPROC];
+    struct proc *procs[NPROC];
+};
+
+// `collectVMs()` fills `collecting` from a hashmap_iterate() callback.
+static struct vmList *collecting;
+
+void collectRegisteredVM(uint64 key, void *value) {
+  if (collecting->count < NPROC) {
+    collecting->pids[collecting->count] = (int) key;
+    collecting->procs[collecting->count] = (struct proc *) value;
+    collecting->count += 1;
+  }
+}
+
+void collectVMs(struct vmList *list) {
+  acquire(&collectLock);
+  collecting = list;
+  list->count = 0;
+  hashmap_iterate(&vmmState.registeredVMs, collectRegisteredVM);
+  collecting = 0x0;
+  release(&collectLock);
+}
+
+// Registered VMs of the current sampling round.
+static struct vmList sampled;
+
+// Stable pages that only `knownPages` still refers to.
+static uint64 unusedPages[PGSIZE / sizeof(uint64)];
+static int unusedCount;
+
+void collectUnusedPage(uint64 pa, void *value) {
+  (void) (value);
+  if (unusedCount < NELEM(unusedPages) && cowRefCount(pa) == 1) {
+    unusedPages[unusedCount] = pa;
+    unusedCount += 1;
+  }
+}
+
+// A VM's page table may only be changed by the scanner while the VM is
+// not running and is not stopped in the middle of kernel code. Caller
+// must hold p->lock.
+int isScannable(struct proc *p, int pid) {
+  if (p->pid != pid)
+    return 0;
+  return (p->state == SLEEPING) || (p->state == RUNNABLE && p->kpreempted == 0);
+}
+
+// Replace the mapping of `va` with a COW mapping of the stable page `stablePA`.
+void mergePage(struct proc *p, uint64 va, uint64 stablePA) {
+  pte_t *pte = walk(p->pagetable, va, 0);
+  uint64 flags = cowFlags(PTE_FLAGS(*pte));
+  if (frameCharged(PTE2PA(*pte)))
+    __atomic_sub_fetch(&p->rss, 1, __ATOMIC_RELAXED); // Stable frames are not charged.
+
+  uvmunmap(p->pagetable, va, 1, 1);
+  if (mappages(p->pagetable, va, PGSIZE, stablePA, (int) flags) != 0)
+    panic("mergePage: mappages");
+  vmmState.pagesMerged += 1;
+  __atomic_add_fetch(&p->pagesMerged, 1, __ATOMIC_RELAXED);
+}
+
+// Write protect the page mapped at `va` and make it the stable copy of
+// its content. Only a page that no other process maps may become stable,
+// see scanPage(), since the frame stops being charged to its mappers.
+void stabilizePage(struct proc *p, uint64 va, uint64 fingerprint) {
+  pte_t *pte = walk(p->pagetable, va, 0);
+  uint64 pa = PTE2PA(*pte);
+
+  if ((*pte & PTE_COW) == 0) {
+    uint64 flags = cowFlags(PTE_FLAGS(*pte));
+    uvmunmap(p->pagetable, va, 1, 0);
+    if (mappages(p->pagetable, va, PGSIZE, pa, (int) flags) != 0)
+      panic("stabilizePage: mappages");
+  }
+  __atomic_sub_fetch(&p->rss, 1, __ATOMIC_RELAXED); // Stable frames are not charged.
+
+  cowRefIncrement(pa); // Reference held by `knownPages`.
+  frameSetFlags(pa, FRAME_KSM);
+  pageHashmap_putHashed(&vmmState.knownPages, pa, fingerprint, (void *) pa);
+}
+
+// Fold the accessed and dirty bits of the user page at *pte into the
+// age of its frame, and clear them. Caller must hold p->lock of the VM,
+// with the VM scannable. Returns the age of the frame, in samples.
+uint samplePage(pte_t *pte) {
+  uint64 pa = PTE2PA(*pte);
+  if ((*pte & (PTE_A | PTE_D)) != 0) {
+    frameTouch(pa, (*pte & PTE_D) != 0);
+    *pte &= ~(PTE_A | PTE_D);
+  }
+  return frameAge(pa);
+}
+
+/*
+ * Pages are merged in two steps, similar to KSM in Linux. The first time
+ * some content is seen, the page is only remembered in `unstablePages`.
+ * If another page with the same content shows up, it is write protected
+ * and becomes the stable copy in `knownPages`. All later pages with that
+ * content are then mapped COW to the stable copy and their frames freed.
+ * Writing to a merged page breaks the share in `handleCOWPageFault()`.
+ */
+void scanPage(struct proc *p, uint64 va) {
+  pagetable_t pagetable = p->pagetable;
+  int level;
+  pte_t *pte = walkLeaf(pagetable, va, &level);
+  if ((pte == 0x0) || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+    return;
+  if (level != 0)
+    return; // Merging would split the superpage, leave it alone.
+
+  uint64 pa = PTE2PA(*pte);
+  if (pa == PRE_KERNEL_ADDRESS || pa == getZeroFrame())
+    return;
+  // A page written in this sample is likely to change again, merging
+  // it would only be undone by a COW fault.
+  if ((*pte & PTE_COW) == 0) {
+    samplePage(pte);
+    if (frameWriteAge(pa) == 0)
+      return;
+  }
+  vmmState.pagesScanned += 1;
+  __atomic_add_fetch(&p->pagesScanned, 1, __ATOMIC_RELAXED);
+
+  // Untouched guest memory is mostly zeros. Such pages share the zero
+  // frame directly, without being hashed or entered in the tables.
+  if (pageIsZero(pa)) {
+    mergePage(p, va, getZeroFrame());
+    vmmState.zeroPagesMerged += 1;
+    return;
+  }
+
+  uint64 knownPA, fingerprint = hashPage(pa);
+  if (pageHashmap_getHashed(&vmmState.knownPages, pa, fingerprint, (void **) &knownPA) == 1) {
+    if (knownPA != pa)
+      mergePage(p, va, knownPA);
+    return;
+  }
+
+  if ((*pte & PTE_COW) != 0 && cowRefCount(pa) > 1) {
+    return; // Shared by fork(), it can only be merged into a stable page.
+  } else if ((*pte & PTE_COW) != 0) {
+    // Already read-only, so its content can't change under us.
+    stabilizePage(p, va, fingerprint);
+  } else if (pageHashmap_getHashed(&vmmState.unstablePages, pa, fingerprint, (void **) &knownPA) == 1) {
+    if (knownPA != pa) {
+      pageHashmap_delete(&vmmState.unstablePages, pa);
+      stabilizePage(p, va, fingerprint);
+    }
+  } else {
+    pageHashmap_putHashed(&vmmState.unstablePages, pa, fingerprint, (void *) pa);
+  }
+}
+
+// Page out the page at `va` of the VM `p`, unless it was accessed in
+// the last `minAge` samples. Only private 4 KiB pages are paged out.
+// Caller must hold p->lock, with the VM scannable or current. Returns
+// the swap slot to pass to swapWrite() once p->lock is released, or -1.
+int evictPage(struct proc *p, uint64 va, uint minAge) {
+  int level;
+  pte_t *pte = walkLeaf(p->pagetable, va, &level);
+  if ((pte == 0x0) || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+    return -1;
+  if (level != 0 || (*pte & PTE_COW) != 0 || PTE2PA(*pte) == PRE_KERNEL_ADDRESS)
+    return -1;
+  if (samplePage(pte) < minAge)
+    return -1;
+
+  int slot = swapAlloc(PTE2PA(*pte));
+  if (slot < 0)
+    return -1;
+  *pte = SLOT2PTE(slot) | (PTE_FLAGS(*pte) & ~(PTE_V | PTE_A | PTE_D)) | PTE_SWAP;
+  __atomic_sub_fetch(&p->rss, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&p->pagesSwapped, 1, __ATOMIC_RELAXED);
+  return slot;
+}
+
+// Move the clock hand over the pages of the VM `p` from `*va`, paging
+// out pages older than `minAge` until `npages` are out, `*budget` pages
+// were looked at or the end of the VM. Gives up if the VM stays busy.
+// Returns the number of pages paged out.
+int sweepVM(struct proc *p, int pid, uint64 *va, int npages, int *budget, uint minAge) {
+  int out = 0, tries = 0;
+  if (p == myproc())
+    return 0; // Never scannable, see isScannable().
+  while (out < npages && *budget > 0) {
+    acquire(&p->lock);
+    if (p->pid != pid || p->state == ZOMBIE || *va >= p->sz) {
+      release(&p->lock);
+      break;
+    }
+    if (!isScannable(p, pid)) {
+      release(&p->lock);
+      if (++tries == 10)
+        break;
+      yield();
+      continue;
+    }
+    int slot = evictPage(p, *va, minAge);
+    release(&p->lock);
+
+    *va += PGSIZE;
+    *budget -= 1;
+    if (slot >= 0) {
+      swapWrite(slot);
+      out += 1;
+    }
+  }
+  return out;
+}
+
+// Page out up to `npages` cold pages of the registered VMs. The clock
+// hand goes round the VMs, first paging out pages outside the working
+// set of their VM, then, if that was not enough, any page not accessed
+// in the current sample. Sleeps, so the caller must not hold a spinlock.
+// Returns the number of pages paged out.
+int reclaimPages(int npages) {
+  struct vmList vms;
+  collectVMs(&vms);
+  if (vms.count == 0)
+    return 0;
+
+  acquiresleep(&hand.lock);
+  int idx = 0, pages = 0;
+  for (int i = 0; i < vms.count; i++) {
+    if (vms.pids[i] == hand.pid)
+      idx = i;
+    pages += vms.procs[i]->sz / PGSIZE;
+  }
+  if (vms.pids[idx] != hand.pid) {
+    hand.pid = vms.pids[idx];
+    hand.va = 0;
+  }
+
+  uint minAges[] = {WSSWINDOW, 1};
+  int out = 0;
+  for (int round = 0; round < NELEM(minAges) && out < npages; round++) {
+    int budget = pages;
+    for (int visits = 0; out < npages && budget > 0 && visits <= vms.count; visits++) {
+      out += sweepVM(vms.procs[idx], vms.pids[idx], &hand.va, npages - out, &budget, minAges[round]);
+      if (out < npages) {
+        idx = (idx + 1) % vms.count;
+        hand.pid = vms.pids[idx];
+        hand.va = 0;
+      }
+    }
+  }
+  releasesleep(&hand.lock);
+  return out;
+}
+
+// Page out up to `npages` pages of the calling process, to make room
+// under its limit. The clock hand in p->reclaimVA goes round its pages,
+// first paging out pages outside its working set, then any page not
+// accessed in the current sample, and as a last resort any page at all,
+// since the process can't wait for others to give memory back.
+// Sleeps, so the caller must not hold a spinlock.
+// Returns the number of pages paged out.
+int reclaimOwnPages(int npages) {
+  struct proc *p = myproc();
+  uint minAges[] = {WSSWINDOW, 1, 0};
+  int out = 0;
+  for (int round = 0; round < NELEM(minAges) && out < npages; round++) {
+    for (uint64 seen = 0; out < npages && seen < p->sz; seen += PGSIZE) {
+      if (p->reclaimVA >= p->sz)
+        p->reclaimVA = 0;
+      acquire(&p->lock);
+      int slot = evictPage(p, p->reclaimVA, minAges[round]);
+      release(&p->lock);
+
+      p->reclaimVA += PGSIZE;
+      if (slot >= 0) {
+        swapWrite(slot);
+        out += 1;
+      }
+    }
+  }
+  return out;
 }
 
-void randomSampling() {
-  acquire(&vmmState.samplingTimeLock);
-  uint currTime = getCurrTime();
-  uint64 timeDiff = currTime - vmmState.lastSamplingTime;
-  if (((vmmState.lastSamplingTime == 0) && (timeDiff >= 100)) || (timeDiff >= VMMRANDTICKS)) {
-//    printf("%d -> %d <--> Performing random sampling...\n", lastMemorySamplingTime, currTime);
-    vmmState.lastSamplingTime = currTime;
-    // TODO: Code for random sampling
+// Sample the accessed and dirty bits of every resident page of the VM
+// `p`, see samplePage(). Each page is sampled under its own p->lock hold.
+void sampleVM(struct proc *p, int pid) {
+  uint64 zero = getZeroFrame();
+  int tries = 0;
+  for (uint64 va = 0;;) {
+    acquire(&p->lock);
+    if (p->pid != pid || p->state == ZOMBIE || va >= p->sz) {
+      release(&p->lock);
+      return;
+    }
+    if (!isScannable(p, pid)) {
+      release(&p->lock);
+      if (++tries == 10)
+        return; // Its remaining pages look one sample older.
+      yield();
+      continue;
+    }
+
+    int level = 0;
+    pte_t *pte = walkLeaf(p->pagetable, va, &level);
+    if (pte != 0x0 && (*pte & PTE_V) != 0 && (*pte & PTE_U) != 0 &&
+        PTE2PA(*pte) != PRE_KERNEL_ADDRESS && PTE2PA(*pte) != zero)
+      samplePage(pte);
+    release(&p->lock);
+    va = (pte != 0x0 && level == 1) ? va - va % SUPERPGSIZE + SUPERPGSIZE : va + PGSIZE;
+  }
+}
+
+// Start a new sample and sample every registered VM.
+void sampleVMs() {
+  struct vmList vms;
+  collectVMs(&vms);
+  frameAgeTick();
+  for (int i = 0; i < vms.count; i++)
+    sampleVM(vms.procs[i], vms.pids[i]);
+}
+
+// Called after every registered VM has been scanned once.
+void finishScanPass() {
+  // Unstable entries may since have been written to or freed.
+  pageHashmap_free(&vmmState.unstablePages);
+
+  // Release stable pages whose last mapping went away.
+  unusedCount = 0;
+  pageHashmap_iterate(&vmmState.knownPages, collectUnusedPage);
+  for (int i = 0; i < unusedCount; i++) {
+    pageHashmap_delete(&vmmState.knownPages, unusedPages[i]);
+    frameClearFlags(unusedPages[i], FRAME_KSM);
+    cowRefDecrement(unusedPages[i], 1);
+  }
+}
+
+// Scan up to `budget` pages of the registered VMs, resuming from
+// `lastSampledProcess` and `lastSampledVA`. Each page is scanned under
+// its own p->lock hold, so the VMs are never kept off a CPU for long.
+// Returns the number of registered VMs.
+int scanRegisteredVMs(uint budget) {
+  collectVMs(&sampled);
+  if (sampled.count == 0) {
+    vmmState.lastSampledProcess = 0x0;
+    vmmState.lastSampledVA = 0;
+    return 0;
+  }
+
+  int idx = 0;
+  uint64 va = 0;
+  for (int i = 0; i < sampled.count; i++) {
+    if (sampled.procs[i] == vmmState.lastSampledProcess) {
+      idx = i;
+      va = vmmState.lastSampledVA;
+      break;
+    }
+  }
+
+  for (int visited = 0; budget > 0 && visited < sampled.count; budget--) {
+    struct proc *p = sampled.procs[idx];
+    int pid = sampled.pids[idx];
+
+    acquire(&p->lock);
+    int stale = (p->pid != pid);
+    int done = !isScannable(p, pid) || (va >= p->sz);
+    if (!done)
+      scanPage(p, va);
+    release(&p->lock);
+
+    if (stale)
+      hashmap_delete(&vmmState.registeredVMs, pid); // VM exited without demoting.
+    if (!done) {
+      va += PGSIZE;
+      continue;
+    }
+
+    // Move on to the next VM. A VM that is busy right now is
+    // skipped for this pass.
+    visited += 1;
+    va = 0;
+    if (++idx == sampled.count) {
+      idx = 0;
+      finishScanPass();
+    }
+  }
+
+  vmmState.lastSampledProcess = sampled.procs[idx];
+  vmmState.lastSampledVA = va;
+  return sampled.count;
+}
+
+// Body of the VMM scanner kernel thread. Scans `scanBudget` pages per
+// round and sleeps in between, so that no more than `scanRate` pages
+// are scanned per second. Only this thread touches the scan state.
+// Every WSSINTERVAL ticks it also samples the working sets of the VMs.
+void vmmScanner() {
+  uint lastSample = 0;
+  for (;;) {
+    acquire(&tickslock);
+    uint now = ticks;
+    release(&tickslock);
+    if (now - lastSample >= WSSINTERVAL) {
+      lastSample = now;
+      sampleVMs();
+    }
+
+    acquire(&vmmState.lock);
+    uint budget = vmmState.scanBudget;
+    uint rate = vmmState.scanRate;
+    release(&vmmState.lock);
+
+    if (getFreeListSize() < SWAPLOWPAGES)
+      reclaimPages(SWAPBATCH);
+
+    uint64 delay = VMMRANDTICKS;
+    if (scanRegisteredVMs(budget) > 0) {
+      delay = ((uint64) budget * TICKSPERSEC) / rate; // budget may be up to 2^31 - 1.
+      if (delay == 0)
+        delay = 1;
+    }
+    sleepTicks(delay);
+  }
+}
+
+// Set the number of pages scanned per round and the maximum number
+// of pages scanned per second. Non-positive values are left unchanged.
+int sys_vm_scanconfig() {
+  int budget, rate;
+  argint(0, &budget);
+  argint(1, &rate);
+
+  acquire(&vmmState.lock);
+  if (budget > 0)
+    vmmState.scanBudget = budget;
+  if (rate > 0)
+    vmmState.scanRate = rate;
+  release(&vmmState.lock);
+  return 0;
+}
+
+// Histogram bucket of a page last accessed `age` samples ago:
+// 0, 1, 2-3, 4-7, ..., and the last bucket for anything older.
+int ageBucket(uint age) {
+  int bucket = 0;
+  while (age > 0 && bucket < NAGEBUCKETS - 1) {
+    age >>= 1;
+    bucket += 1;
+  }
+  return bucket;
+}
+
+// Add `npages` pages backed by the frame at `pa`, mapped by *pte, to the
+// working set counts of `st`. An accessed or dirty bit that was not
+// sampled yet counts as an access in the current sample.
+void countAge(pte_t *pte, uint64 pa, uint64 npages, struct vmstat *st) {
+  uint age = (*pte & PTE_A) ? 0 : frameAge(pa);
+  uint writeAge = (*pte & PTE_D) ? 0 : frameWriteAge(pa);
+  st->ageHistogram[ageBucket(age)] += npages;
+  if (age < WSSWINDOW)
+    st->workingSet += npages;
+  if (writeAge < WSSWINDOW)
+    st->writeSet += npages;
+}
+
+// Count the pages of VM `p` by how they are backed. Caller must hold p->lock.
+void countVMPages(struct proc *p, struct vmstat *st) {
+  uint64 zero = getZeroFrame();
+  for (uint64 va = 0; va < p->sz; va += PGSIZE) {
+    int level;
+    pte_t *pte = walkLeaf(p->pagetable, va, &level);
+    if (pte != 0x0 && PTE_SWAPPED(*pte))
+      st->swappedPages += 1;
+    if (pte == 0x0 || (*pte & PTE_V) == 0 || PTE2PA(*pte) == PRE_KERNEL_ADDRESS)
+      continue;
+    if (level != 0) {
+      st->residentPages += SUPERPGSIZE / PGSIZE;
+      countAge(pte, PTE2PA(*pte), SUPERPGSIZE / PGSIZE, st);
+      va += SUPERPGSIZE - PGSIZE;
+      continue;
+    }
+
+    uint64 pa = PTE2PA(*pte);
+    st->residentPages += 1;
+    if (pa != zero)
+      countAge(pte, pa, 1, st);
+    if (pa == zero) {
+      st->zeroPages += 1;
+    } else if ((*pte & PTE_COW) != 0) {
+      st->sharedPages += 1;
+      if ((frameFlags(pa) & FRAME_KSM) != 0)
+        st->mergedPages += 1;
+    }
+  }
+}
+
+// Fill in `st` for the VM `p` with pid `pid`. The page table is only
+// walked while the VM is off the CPU, like the scanner does. Returns
+// -1 if the VM has exited.
+int getVMStats(struct proc *p, int pid, struct vmstat *st) {
+  memset(st, 0, sizeof(*st));
+  st->pid = pid;
+  for (int tries = 0; tries < 10; tries++) {
+    acquire(&p->lock);
+    if (p->pid != pid || p->state == ZOMBIE) {
+      release(&p->lock);
+      return -1;
+    }
+    st->pagesScanned = p->pagesScanned;
+    st->pagesMerged = p->pagesMerged;
+    st->pagesUnmerged = p->pagesUnmerged;
+    st->pagesSwapped = p->pagesSwapped;
+    st->rss = p->rss;
+    st->rssLimit = p->rssLimit;
+    st->share = p->share;
+    st->runtime = p->runtime / (TIMERHZ / 1000);
+    if (isScannable(p, pid)) {
+      countVMPages(p, st);
+      st->sampled = 1;
+    }
+    release(&p->lock);
+    if (st->sampled)
+      break;
+    yield();
   }
-  release(&vmmState.samplingTimeLock);
+  return 0;
+}
+
+// vm_stats(struct vmstat *vms, int max, struct vmmstat *totals)
+// Copies the statistics of up to `max` registered VMs to `vms`, and
+// the scanner totals to `totals` if it is not 0.
+// Returns the number of VMs copied, or -1 on a bad address.
+int sys_vm_stats() {
+  uint64 vmsAddr, totalsAddr;
+  int max;
+  argaddr(0, &vmsAddr);
+  argint(1, &max);
+  argaddr(2, &totalsAddr);
+
+  struct proc *me = myproc();
+  struct vmList vms;
+  collectVMs(&vms);
+
+  int n = 0;
+  for (int i = 0; i < vms.count && n < max; i++) {
+    struct vmstat st;
+    if (getVMStats(vms.procs[i], vms.pids[i], &st) != 0)
+      continue;
+    if (copyout(me->pagetable, vmsAddr + n * sizeof(st), (char *) &st, sizeof(st)) < 0)
+      return -1;
+    n += 1;
+  }
+
+  if (totalsAddr != 0) {
+    struct vmmstat total;
+    total.pagesScanned = vmmState.pagesScanned;
+    total.pagesMerged = vmmState.pagesMerged;
+    total.zeroPagesMerged = vmmState.zeroPagesMerged;
+    acquire(&vmmState.knownPages.lock);
+    total.stablePages = vmmState.knownPages.size;
+    release(&vmmState.knownPages.lock);
+    total.freePages = getFreeListSize();
+    total.superpages = getSuperpageCount();
+    swapStats(&total.swapUsed, &total.swapTotal, &total.pagesOut, &total.pagesIn);
+    if (copyout(me->pagetable, totalsAddr, (char *) &total, sizeof(total)) < 0)
+      return -1;
+  }
+  return n;
 }
 
 void printRegisteredVM(uint64 key, void *value) {
@@ -45,7 +624,118 @@ void printRegisteredVM(uint64 key, void *value) {
 void printRegisteredVMs() {
   printf("\nRegistered VMs:\n");
   hashmap_iterate(&vmmState.registeredVMs, printRegisteredVM);
-  printf("\n");
+  printf("Lock contention: %d\n\n", (int) hashmap_contention(&vmmState.registeredVMs));
+}
+
+// The registered VM `pid`, if the caller is its parent. Returns 0x0 otherwise.
+struct proc *getOwnVM(int pid) {
+  struct proc *c, *vm;
+  if ((pid == 0) || ((c = get_proc_from_pid(pid)) == 0x0))
+    return 0x0;
+  if ((c->parent == 0x0) || (c->parent->pid != myproc()->pid))
+    return 0x0;
+  if (hashmap_get(&vmmState.registeredVMs, pid, (void **) &vm) == 0)
+    return 0x0;
+  return c;
+}
+
+// vm_limit(int pid, int pages)
+// Caps the frames charged to the VM `pid` at `pages`, or removes the cap
+// if `pages` is 0. A VM already above the new cap keeps its frames, but
+// pages out its own to make room for new ones, see reclaimOwnPages().
+// Only the parent may call it.
+int sys_vm_limit() {
+  int pid, pages;
+  argint(0, &pid);
+  argint(1, &pages);
+  struct proc *p;
+  if (pages < 0 || (p = getOwnVM(pid)) == 0x0)
+    return -1;
+
+  acquire(&p->lock);
+  if (p->pid == pid)
+    p->rssLimit = pages;
+  release(&p->lock);
+  return 0;
+}
+
+// vm_share(int pid, int share)
+// Sets the CPU share of the VM `pid`, or resets it to DEFAULTSHARE if
+// `share` is 0. Runnable processes on a CPU get time in proportion to
+// their shares. Children of the VM inherit its share. Only the parent
+// may call it.
+int sys_vm_share() {
+  int pid, share;
+  argint(0, &pid);
+  argint(1, &share);
+  struct proc *p;
+  if (share < 0 || share > MAXSHARE || (p = getOwnVM(pid)) == 0x0)
+    return -1;
+
+  acquire(&p->lock);
+  if (p->pid == pid)
+    p->share = (share == 0) ? DEFAULTSHARE : share;
+  release(&p->lock);
+  return 0;
+}
+
+// Give back the all-zero private page at `va` of the VM `p`, by mapping
+// the zero frame in its place. Caller must hold p->lock, with the VM
+// scannable. Returns 1 if the page was reclaimed.
+int balloonPage(struct proc *p, uint64 va) {
+  int level;
+  pte_t *pte = walkLeaf(p->pagetable, va, &level);
+  if ((pte == 0x0) || (*pte & PTE_V) == 0 || (*pte & PTE_U) == 0)
+    return 0;
+  if (level != 0 || (*pte & PTE_COW) != 0)
+    return 0;
+  uint64 pa = PTE2PA(*pte);
+  if (pa == PRE_KERNEL_ADDRESS || !pageIsZero(pa))
+    return 0;
+  mergePage(p, va, getZeroFrame());
+  vmmState.zeroPagesMerged += 1;
+  return 1;
+}
+
+// vm_balloon(int pid, int pages)
+// Reclaims up to `pages` frames from the VM `pid` without waiting for
+// the scanner. The VM manager calls this when memory runs low. All-zero
+// pages are given up first, then other private pages are paged out.
+// Only the parent may call it. Returns the number of frames reclaimed,
+// or -1.
+int sys_vm_balloon() {
+  int pid, pages;
+  argint(0, &pid);
+  argint(1, &pages);
+  struct proc *p;
+  if (pages < 0 || (p = getOwnVM(pid)) == 0x0)
+    return -1;
+
+  int reclaimed = 0, tries = 0;
+  uint64 va = 0;
+  while (reclaimed < pages) {
+    acquire(&p->lock);
+    if (p->pid != pid || p->state == ZOMBIE || va >= p->sz) {
+      release(&p->lock);
+      break;
+    }
+    if (!isScannable(p, pid)) {
+      release(&p->lock);
+      if (++tries == 10)
+        break;
+      yield();
+      continue;
+    }
+    reclaimed += balloonPage(p, va);
+    release(&p->lock);
+    va += PGSIZE;
+  }
+
+  int budget = PGROUNDUP(p->sz) / PGSIZE;
+  va = 0;
+  if (reclaimed < pages)
+    reclaimed += sweepVM(p, pid, &va, pages - reclaimed, &budget, 0);
+  return reclaimed;
 }
 
 int sys_vm_promote() {
@@ -1,10 +1,21 @@
 typedef struct VMM_STATE {
-    struct spinlock samplingTimeLock;
-    uint lastSamplingTime;
+    // Protects the scanner tunables below.
+    struct spinlock lock;
+    uint scanBudget; // Pages scanned per round.
+    uint scanRate;   // Upper limit on pages scanned per second.
 
     HASHMAP registeredVMs;
-    HASHMAP knownPages;
+    // Pages merged so far. Every entry is a read-only COW page and
+    // the hashmap holds a COW reference of its own to keep it alive.
+    PAGE_HASHMAP knownPages;
+    // Candidate pages seen during the current pass. These are still
+    // writable, so an entry is only a hint and is re-checked on use.
+    PAGE_HASHMAP unstablePages;
 
     struct proc *lastSampledProcess;
     uint64 lastSampledVA;
+
+    uint64 pagesScanned;
+    uint64 pagesMerged;
+    uint64 zeroPagesMerged; // Part of `pagesMerged` mapped to the zero frame.
 } VMM_STATE;
@@ -0,0 +1,39 @@
+// Buckets of `ageHistogram`, by samples since the last access:
+// 0, 1, 2-3, 4-7, 8-15, and 16 or more.
+#define NAGEBUCKETS 6
+
+// Memory statistics of one registered VM, filled in by vm_stats().
+struct vmstat {
+  int pid;
+  int sampled;            // 0 if the VM was busy, so the page counts are missing
+  uint64 residentPages;   // Pages backed by a frame, own or shared
+  uint64 sharedPages;     // Pages shared COW, by fork or by merging
+  uint64 mergedPages;     // Pages mapped to a stable page of the scanner
+  uint64 zeroPages;       // Pages mapped to the shared zero frame
+  uint64 swappedPages;    // Pages paged out to the swap area
+  uint64 workingSet;      // Resident pages accessed in the last WSSWINDOW samples
+  uint64 writeSet;        // Resident pages written in the last WSSWINDOW samples
+  uint64 ageHistogram[NAGEBUCKETS]; // Resident pages by samples since last access
+  uint64 pagesScanned;    // Times the scanner looked at a page of this VM
+  uint64 pagesMerged;     // Pages the scanner merged
+  uint64 pagesUnmerged;   // Merged or zero pages later written to
+  uint64 pagesSwapped;    // Times a page of this VM was paged out
+  uint64 rss;             // Frames charged to the VM
+  uint64 rssLimit;        // Most frames charged, 0 if unlimited
+  uint64 share;           // CPU share, see vm_share()
+  uint64 runtime;         // CPU time used, in milliseconds
+};
+
+// System wide totals of the VMM page scanner.
+struct vmmstat {
+  uint64 pagesScanned;
+  uint64 pagesMerged;
+  uint64 zeroPagesMerged;
+  uint64 stablePages;     // Pages in the stable table
+  uint64 freePages;
+  uint64 superpages;
+  uint64 swapUsed;        // Swap slots in use, in pages
+  uint64 swapTotal;
+  uint64 pagesOut;        // Pages written to swap
+  uint64 pagesIn;         // Pages read back from swap
+};
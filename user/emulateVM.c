@@ -15,6 +15,11 @@ int getUserChoiceInt(char *prompt) {
              " 1. Create New VM\n"
              " 2. Delete a VM\n"
              " 3. Print active VM\n"
+             " 4. Tune page scanner\n"
+             " 5. Print memory statistics\n"
+             " 6. Set VM memory limit\n"
+             " 7. Reclaim memory from a VM\n"
+             " 8. Set VM CPU share\n"
              "> ";
 
   return atoi(getUserChoice(prompt));
@@ -34,7 +39,7 @@ int main(void) {
       case 1:
         reg1 = createVM(getUserChoice("Enter workload number: "));
         if (reg1 == -1) {
-          printf("Fork Failed.\n");
+          printf("Spawn Failed.\n");
         } else if (reg1 == -2) {
           printf("Cannot create VM. Max limit reached.\n");
         } else {
@@ -57,6 +62,50 @@ int main(void) {
         printActiveVM();
         break;
 
+      case 4:
+        reg1 = getUserChoiceInt("Enter pages per round (0 to keep): ");
+        vm_scanconfig(reg1, getUserChoiceInt("Enter pages per second (0 to keep): "));
+        printf("Page scanner updated.\n");
+        break;
+
+      case 5:
+        printVMStats();
+        break;
+
+      case 6:
+        reg1 = getUserChoiceInt("Enter VM Id: ");
+        reg1 = setVMLimit(reg1, getUserChoiceInt("Enter page limit (0 for none): "));
+        if (reg1 == -1) {
+          printf("Invalid Index or limit.\n");
+        } else if (reg1 == 0) {
+          printf("VM does not exists.\n");
+        } else {
+          printf("VM limit updated.\n");
+        }
+        break;
+
+      case 7:
+        reg1 = getUserChoiceInt("Enter VM Id: ");
+        reg1 = balloonVM(reg1, getUserChoiceInt("Enter pages to reclaim: "));
+        if (reg1 == -1) {
+          printf("Invalid Index or VM does not exists.\n");
+        } else {
+          printf("Reclaimed %d pages.\n", reg1);
+        }
+        break;
+
+      case 8:
+        reg1 = getUserChoiceInt("Enter VM Id: ");
+        reg1 = setVMShare(reg1, getUserChoiceInt("Enter CPU share (0 for default): "));
+        if (reg1 == -1) {
+          printf("Invalid Index or share.\n");
+        } else if (reg1 == 0) {
+          printf("VM does not exists.\n");
+        } else {
+          printf("VM share updated.\n");
+        }
+        break;
+
       default:
         break;
     }
@@ -1,6 +1,8 @@
 #include "./../kernel/types.h"
 
 struct stat;
+struct vmstat;
+struct vmmstat;
 struct spinlock;
 
 // system calls
@@ -30,6 +32,12 @@ int vm_promote(int);
 int vm_demote(int);
 int va2pa(uint64, uint8);
 int getsize();
+int vm_scanconfig(int, int);
+int vm_stats(struct vmstat*, int, struct vmmstat*);
+int vm_limit(int, int);
+int vm_balloon(int, int);
+int spawn(const char*, char**, int*);
+int vm_share(int, int);
 
 // user/ulib.c
 char* strcpy(char*, const char*);
@@ -63,3 +71,7 @@ void initVMManager(void);
 int createVM(char *);
 int deleteVM(int);
 void printActiveVM(void);
+void printVMStats(void);
+int setVMLimit(int, int);
+int balloonVM(int, int);
+int setVMShare(int, int);
@@ -7,6 +7,7 @@
 #include "./../kernel/syscall.h"
 #include "./../kernel/memlayout.h"
 #include "./../kernel/riscv.h"
+#include "./../kernel/vmmstat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -2571,6 +2572,611 @@ badarg(char *s)
   exit(0);
 }
 
+// sbrk() only reserves memory; the first touch allocates it. copyout()
+// into, and copyin() and copyinstr() from, pages that were never
+// touched must work as if they had been.
+void
+lazycopy(char *s)
+{
+  char *a = sbrk(4*PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+
+  // copyout() into an untouched page, across into a second one.
+  int fd = open("README", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open(README) failed\n", s);
+    exit(1);
+  }
+  char *dst = a + PGSIZE - 10;
+  int n = read(fd, dst, 20);
+  close(fd);
+  if(n != 20){
+    printf("%s: read into lazy pages returned %d, not 20\n", s, n);
+    exit(1);
+  }
+  if(memcmp(dst, "xv6 is a re-implemen", 20) != 0){
+    printf("%s: read into lazy pages lost the data\n", s);
+    exit(1);
+  }
+
+  // copyin() from an untouched page sees zeros.
+  int fds[2];
+  if(pipe(fds) < 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  char *src = a + 2*PGSIZE;
+  if(write(fds[1], src, 64) != 64){
+    printf("%s: write from a lazy page failed\n", s);
+    exit(1);
+  }
+  char zeros[64];
+  memset(zeros, 0xff, sizeof(zeros));
+  if(read(fds[0], zeros, sizeof(zeros)) != sizeof(zeros)){
+    printf("%s: pipe read failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < sizeof(zeros); i++){
+    if(zeros[i] != 0){
+      printf("%s: lazy page not zero\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  // copyinstr() from an untouched page reads the empty string,
+  // which names the current directory.
+  struct stat st, dot;
+  fd = open(a + 3*PGSIZE + 100, O_RDONLY);
+  if(fd < 0 || fstat(fd, &st) < 0 || stat(".", &dot) < 0 ||
+     st.dev != dot.dev || st.ino != dot.ino){
+    printf("%s: open of an empty path from a lazy page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // the page is still writable after being read.
+  src[0] = 'x';
+  if(src[0] != 'x' || src[1] != 0){
+    printf("%s: write after read of a lazy page failed\n", s);
+    exit(1);
+  }
+
+  exit(0);
+}
+
+// fork() of reserved pages that were never touched. Parent and child
+// each see zeros and their own writes only.
+void
+lazyfork(char *s)
+{
+  enum { N = 64 };
+  char *a = sbrk(N*PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  a[0] = 'p'; // one touched page among the lazy ones.
+
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(int i = 1; i < N; i++){
+      if(a[i*PGSIZE] != 0){
+        printf("%s: child sees non-zero lazy page\n", s);
+        exit(1);
+      }
+      if(i % 2 == 0)
+        a[i*PGSIZE] = 'c';
+    }
+    if(a[0] != 'p'){
+      printf("%s: child lost the touched page\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+
+  for(int i = 1; i < N; i += 3)
+    a[i*PGSIZE] = 'q';
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(int i = 1; i < N; i++){
+    char want = (i % 3 == 1) ? 'q' : 0;
+    if(a[i*PGSIZE] != want){
+      printf("%s: parent sees the child's write\n", s);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// shrinking the break over pages that were never touched, or only
+// read, must not panic or leak memory.
+void
+lazyunmap(char *s)
+{
+  enum { N = 600 }; // more than a superpage's worth.
+  for(int round = 0; round < 3; round++){
+    char *a = sbrk(N*PGSIZE);
+    if(a == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    for(int i = 0; i < N; i += 7){
+      if(round == 1 && a[i*PGSIZE] != 0){ // read only
+        printf("%s: lazy page not zero\n", s);
+        exit(1);
+      }
+      if(round == 2)
+        a[i*PGSIZE] = 1;
+    }
+    if(sbrk(-N*PGSIZE) == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk shrink failed\n", s);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// after fork, parent and child each write to the pages they share
+// copy-on-write, and must not see each other's writes.
+char cowdata[8*4096] = { 1 };
+void
+cowwrite(char *s)
+{
+  enum { N = 16 };
+  char *a = sbrk(N*PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++)
+    a[i*PGSIZE] = 'a';
+  for(int i = 0; i < sizeof(cowdata); i += PGSIZE)
+    cowdata[i] = 'd';
+
+  int fds[2];
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[1]);
+    for(int i = 0; i < N; i++)
+      a[i*PGSIZE] = 'c';
+    cowdata[0] = 'c';
+    char c;
+    if(read(fds[0], &c, 1) != 1){ // wait for the parent's writes.
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    for(int i = 0; i < N; i++){
+      if(a[i*PGSIZE] != 'c'){
+        printf("%s: child sees the parent's write\n", s);
+        exit(1);
+      }
+    }
+    if(cowdata[0] != 'c' || cowdata[PGSIZE] != 'd'){
+      printf("%s: child data page changed\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+
+  close(fds[0]);
+  for(int i = 0; i < N; i++)
+    a[i*PGSIZE] = 'p';
+  cowdata[PGSIZE] = 'p';
+  if(write(fds[1], "x", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(int i = 0; i < N; i++){
+    if(a[i*PGSIZE] != 'p'){
+      printf("%s: parent sees the child's write\n", s);
+      exit(1);
+    }
+  }
+  if(cowdata[0] != 'd' || cowdata[PGSIZE] != 'p'){
+    printf("%s: parent data page changed\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// fork must succeed with more memory in use than is left free,
+// since the child shares the pages instead of copying them.
+void
+cowpressure(char *s)
+{
+  uint64 n = (PHYSTOP - KERNBASE) / 2 / PGSIZE;
+  char *a = sbrk(n*PGSIZE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(uint64 i = 0; i < n; i++)
+    a[i*PGSIZE] = (char)(i % 251 + 1);
+
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(uint64 i = 0; i < n; i += 64){
+      if(a[i*PGSIZE] != (char)(i % 251 + 1)){
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+      a[i*PGSIZE] = 0;
+    }
+    exit(0);
+  }
+
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(uint64 i = 0; i < n; i++){
+    if(a[i*PGSIZE] != (char)(i % 251 + 1)){
+      printf("%s: parent sees the child's write\n", s);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// text pages are shared with the child, but stay read-only: writing
+// to one kills the writer, and read() into one fails.
+void
+cowtext(char *s)
+{
+  volatile char *text = (char *) cowtext;
+  char old = *text;
+
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    *text = old + 1;
+    exit(1);
+  }
+  int xstatus;
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: child wrote to its text\n", s);
+    exit(1);
+  }
+
+  int fds[2];
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(0);
+  if(write(fds[1], "x", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], (char *) text, 1) > 0){
+    printf("%s: read into text succeeded\n", s);
+    exit(1);
+  }
+  wait(0);
+  if(*text != old){
+    printf("%s: text changed\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// read fd to EOF, close it, and check that it held exactly want.
+void
+spawnout(char *s, int fd, char *want)
+{
+  char buf[32];
+  int n = 0, m;
+  while((m = read(fd, buf + n, sizeof(buf) - 1 - n)) > 0)
+    n += m;
+  buf[n] = 0;
+  close(fd);
+  if(strcmp(buf, want) != 0){
+    printf("%s: spawned output '%s', not '%s'\n", s, buf, want);
+    exit(1);
+  }
+}
+
+// spawn() with inherited descriptors, explicit ones, closed ones,
+// and bad arguments.
+void
+spawnfds(char *s)
+{
+  char *echoargv[] = { "echo", "hi", 0 };
+  char *catargv[] = { "cat", 0 };
+  int p[2], xstatus;
+
+  // fds == 0: the child inherits every open file.
+  if(pipe(p) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  int saved = dup(1);
+  close(1);
+  if(dup(p[1]) != 1){
+    printf("%s: dup failed\n", s);
+    exit(1);
+  }
+  int pid = spawn("echo", echoargv, 0);
+  close(1);
+  dup(saved);
+  close(saved);
+  close(p[1]);
+  if(pid < 0){
+    printf("%s: spawn with fds == 0 failed\n", s);
+    exit(1);
+  }
+  spawnout(s, p[0], "hi\n");
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: echo failed\n", s);
+    exit(1);
+  }
+
+  // explicit descriptors.
+  if(pipe(p) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  int fds[3] = { 0, p[1], 2 };
+  pid = spawn("echo", echoargv, fds);
+  close(p[1]);
+  if(pid < 0){
+    printf("%s: spawn with fds failed\n", s);
+    exit(1);
+  }
+  spawnout(s, p[0], "hi\n");
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: echo failed\n", s);
+    exit(1);
+  }
+
+  // -1 leaves a descriptor closed, so cat can't read its input.
+  if(pipe(p) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  fds[0] = -1;
+  fds[1] = p[1];
+  fds[2] = -1;
+  pid = spawn("cat", catargv, fds);
+  close(p[1]);
+  if(pid < 0){
+    printf("%s: spawn with -1 failed\n", s);
+    exit(1);
+  }
+  spawnout(s, p[0], "");
+  wait(&xstatus);
+  if(xstatus != 1){
+    printf("%s: cat read a closed descriptor\n", s);
+    exit(1);
+  }
+
+  // bad descriptors and paths.
+  int closed = dup(0);
+  close(closed);
+  int bad[] = { 99, NOFILE, -2, closed };
+  for(int i = 0; i < sizeof(bad)/sizeof(bad[0]); i++){
+    fds[0] = 0;
+    fds[1] = bad[i];
+    fds[2] = 2;
+    if(spawn("echo", echoargv, fds) != -1){
+      printf("%s: spawn with fd %d succeeded\n", s, bad[i]);
+      exit(1);
+    }
+  }
+  if(spawn("nosuchfile", echoargv, 0) != -1){
+    printf("%s: spawn of a missing file succeeded\n", s);
+    exit(1);
+  }
+  if(wait(0) != -1){
+    printf("%s: failed spawn left a child\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// echo hi | cat, with both ends of each pipe closed in the parent.
+// cat only sees EOF, and the output ends, if no process spawned
+// holds on to a pipe end it was not given.
+void
+spawnpipe(char *s)
+{
+  char *echoargv[] = { "echo", "hi", 0 };
+  char *catargv[] = { "cat", 0 };
+  int p1[2], p2[2];
+
+  if(pipe(p1) < 0 || pipe(p2) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  int fds1[3] = { 0, p1[1], 2 };
+  int fds2[3] = { p1[0], p2[1], 2 };
+  if(spawn("echo", echoargv, fds1) < 0 || spawn("cat", catargv, fds2) < 0){
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  close(p1[0]);
+  close(p1[1]);
+  close(p2[1]);
+  spawnout(s, p2[0], "hi\n");
+  for(int i = 0; i < 2; i++){
+    int xstatus;
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: pipeline failed\n", s);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// a large sbrk maps its aligned 2 MiB stretches with superpages.
+void
+sbrksuper(char *s)
+{
+  struct vmmstat before, after;
+  if(vm_stats(0, 0, &before) < 0){
+    printf("%s: vm_stats failed\n", s);
+    exit(1);
+  }
+  uint64 n = 3*SUPERPGSIZE; // holds two aligned stretches at least.
+  char *a = sbrk(n);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(uint64 i = 0; i < n; i += PGSIZE){
+    if(a[i] != 0){
+      printf("%s: new heap not zero\n", s);
+      exit(1);
+    }
+    a[i] = (char)(i / PGSIZE + 1);
+  }
+  if(vm_stats(0, 0, &after) < 0){
+    printf("%s: vm_stats failed\n", s);
+    exit(1);
+  }
+  if(after.superpages <= before.superpages){
+    printf("%s: no superpages after a big sbrk\n", s);
+    exit(1);
+  }
+  for(uint64 i = 0; i < n; i += PGSIZE){
+    if(a[i] != (char)(i / PGSIZE + 1)){
+      printf("%s: wrong data at %p\n", s, a + i);
+      exit(1);
+    }
+  }
+  if(sbrk(-(int)n) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+  exit(0);
+}
+
+// a VM over its limit pages out its own pages. reading a pipe into
+// a buffer that was paged out must still fill the buffer.
+void
+swappipe(char *s)
+{
+  enum { N = 64, LIMIT = 16 };
+  int go[2], fds[2];
+  if(pipe(go) < 0 || pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    char c;
+    close(go[1]);
+    close(fds[1]);
+    if(read(go[0], &c, 1) != 1) // wait for the limit.
+      exit(1);
+    char *a = sbrk(N*PGSIZE);
+    if(a == (char*)0xffffffffffffffffL){
+      printf("%s: sbrk failed\n", s);
+      exit(1);
+    }
+    for(int i = 0; i < N; i++)
+      a[i*PGSIZE] = i + 1;
+    for(int i = 0; i < N; i++){
+      if(read(fds[0], a + i*PGSIZE + 8, 4) != 4){
+        printf("%s: read into paged out buffer failed\n", s);
+        exit(1);
+      }
+    }
+    for(int i = 0; i < N; i++){
+      if(a[i*PGSIZE] != i + 1 || memcmp(a + i*PGSIZE + 8, "page", 4) != 0){
+        printf("%s: wrong data in page %d\n", s, i);
+        exit(1);
+      }
+    }
+    struct vmstat st[8];
+    int n = vm_stats(st, 8, 0);
+    for(int i = 0; i < n; i++){
+      if(st[i].pid == getpid() && st[i].pagesSwapped == 0){
+        printf("%s: nothing was paged out\n", s);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+
+  close(go[0]);
+  close(fds[0]);
+  // the child already has its share of our pages charged, so
+  // give it room for LIMIT more.
+  struct vmstat st[8];
+  uint64 rss = 0;
+  if(vm_promote(pid) < 0){
+    printf("%s: vm_promote failed\n", s);
+    exit(1);
+  }
+  int n = vm_stats(st, 8, 0);
+  for(int i = 0; i < n; i++)
+    if(st[i].pid == pid)
+      rss = st[i].rss;
+  if(rss == 0 || vm_limit(pid, rss + LIMIT) < 0){
+    printf("%s: vm_limit failed\n", s);
+    exit(1);
+  }
+  if(write(go[1], "x", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < N; i++){
+    if(write(fds[1], "page", 4) != 4){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  int xstatus;
+  wait(&xstatus);
+  exit(xstatus);
+}
+
 struct test {
   void (*f)(char *);
   char *s;
@@ -2635,6 +3241,16 @@ struct test {
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
   {badarg, "badarg" },
+  {lazycopy, "lazycopy"},
+  {lazyfork, "lazyfork"},
+  {lazyunmap, "lazyunmap"},
+  {sbrksuper, "sbrksuper"},
+  {cowwrite, "cowwrite"},
+  {cowpressure, "cowpressure"},
+  {cowtext, "cowtext"},
+  {spawnfds, "spawnfds"},
+  {spawnpipe, "spawnpipe"},
+  {swappipe, "swappipe"},
 
   { 0, 0},
 };
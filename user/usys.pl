@@ -41,3 +41,9 @@ entry("vm_promote");
 entry("vm_demote");
 entry("va2pa");
 entry("getsize");
+entry("vm_scanconfig");
+entry("vm_stats");
+entry("vm_limit");
+entry("vm_balloon");
+entry("spawn");
+entry("vm_share");
@@ -1,4 +1,5 @@
 #include "./../kernel/types.h"
+#include "./../kernel/vmmstat.h"
 #include "./../user/vm.h"
 #include "./../user/user.h"
 
@@ -44,14 +45,6 @@ VM *findAndLockVMSlot() {
   return 0x0;
 }
 
-void childProcess(char *workloadType) {
-  // Note that after fork, the parent `vm` and child `vm`
-  // have the same VA but DIFFERENT PA.
-  char *params[] = {"vmWorkload", workloadType, 0};
-  int res = exec("vmWorkload", params);
-  printf("Workload exec failed: %d\n", res);
-}
-
 int parentProcess(VM *vm, int vmId, int sleepDuration) {
   if (sleepDuration > 0) { sleep(sleepDuration); }
   vm->pid = vmId;
@@ -72,17 +65,17 @@ int createVM(char *workloadType) {
   VM *vm = findAndLockVMSlot();
   if (vm == 0x0) { return -2; } // Max VMs created.
 
-  int vmId = fork();
-  if (vmId == 0) {
-    childProcess(workloadType);
-    exit(0);
-  } else if (vmId > 0) {
-    if (parentProcess(vm, vmId, 5) == 0)
+  // The workload is started directly, so the manager's memory is never
+  // copied, and it is already running its own image when registered.
+  char *params[] = {"vmWorkload", workloadType, 0};
+  int vmId = spawn("vmWorkload", params, 0);
+  if (vmId > 0) {
+    if (parentProcess(vm, vmId, 0) == 0)
       vmId = 0;
   }
 
   u_lock_release(&vm->lock);
-  return vmId; // -1 If fork was unsuccessful else returns the id of the fork.
+  return vmId; // -1 If spawn was unsuccessful else returns the id of the VM.
 }
 
 int deleteVM(int vmIdx) {
@@ -93,6 +86,47 @@ int deleteVM(int vmIdx) {
   return killVM(&vmHolder[vmIdx], 1, 1);
 }
 
+// Returns -1 for an invalid index, 0 if the VM is not active, 1 otherwise.
+int setVMLimit(int vmIdx, int pages) {
+  if ((vmIdx < 0) || (vmIdx >= MAX_VM) || (pages < 0)) {
+    return -1;
+  }
+
+  VM *vm = &vmHolder[vmIdx];
+  u_lock_acquire(&vm->lock);
+  int res = (vm->status == 1) && (vm_limit(vm->pid, pages) == 0);
+  u_lock_release(&vm->lock);
+  return res;
+}
+
+// Returns -1 for an invalid index or share, 0 if the VM is not active, 1 otherwise.
+int setVMShare(int vmIdx, int share) {
+  if ((vmIdx < 0) || (vmIdx >= MAX_VM) || (share < 0)) {
+    return -1;
+  }
+
+  VM *vm = &vmHolder[vmIdx];
+  u_lock_acquire(&vm->lock);
+  int res = 0;
+  if (vm->status == 1)
+    res = (vm_share(vm->pid, share) == 0) ? 1 : -1;
+  u_lock_release(&vm->lock);
+  return res;
+}
+
+// Returns the number of pages reclaimed, or -1 on failure.
+int balloonVM(int vmIdx, int pages) {
+  if ((vmIdx < 0) || (vmIdx >= MAX_VM) || (pages < 0)) {
+    return -1;
+  }
+
+  VM *vm = &vmHolder[vmIdx];
+  u_lock_acquire(&vm->lock);
+  int res = (vm->status == 1) ? vm_balloon(vm->pid, pages) : -1;
+  u_lock_release(&vm->lock);
+  return res;
+}
+
 void printActiveVM() {
   uint idx = 0;
 
@@ -105,3 +139,54 @@ void printActiveVM() {
   }
   printf("----------------------\n");
 }
+
+void printVMStats() {
+  struct vmstat stats[MAX_VM];
+  struct vmmstat total;
+
+  int n = vm_stats(stats, MAX_VM, &total);
+  if (n < 0) {
+    printf("Failed to read VM statistics.\n");
+    return;
+  }
+
+  printf("\nVM memory (pages):\n");
+  printf("\tPid\tResident\tShared\tMerged\tZero\tSwapped\tScanned\tMerges\tUnmerges\tSwapouts\tRSS\tLimit\n");
+  for (struct vmstat *st = stats; st < &stats[n]; st++) {
+    if (st->sampled) {
+      printf("\t%d\t%l\t\t%l\t%l\t%l\t%l", st->pid, st->residentPages, st->sharedPages,
+             st->mergedPages, st->zeroPages, st->swappedPages);
+    } else {
+      printf("\t%d\t(busy)\t\t-\t-\t-\t-", st->pid);
+    }
+    printf("\t%l\t%l\t%l\t\t%l", st->pagesScanned, st->pagesMerged, st->pagesUnmerged, st->pagesSwapped);
+    if (st->rssLimit != 0) {
+      printf("\t\t%l\t%l\n", st->rss, st->rssLimit);
+    } else {
+      printf("\t\t%l\t-\n", st->rss);
+    }
+  }
+
+  printf("\nVM working sets (pages, by samples since last access):\n");
+  printf("\tPid\tWorking\tWritten\t0\t1\t2-3\t4-7\t8-15\t16+\n");
+  for (struct vmstat *st = stats; st < &stats[n]; st++) {
+    if (!st->sampled)
+      continue;
+    printf("\t%d\t%l\t%l", st->pid, st->workingSet, st->writeSet);
+    for (int i = 0; i < NAGEBUCKETS; i++)
+      printf("\t%l", st->ageHistogram[i]);
+    printf("\n");
+  }
+
+  printf("\nVM CPU:\n");
+  printf("\tPid\tShare\tRuntime (ms)\n");
+  for (struct vmstat *st = stats; st < &stats[n]; st++)
+    printf("\t%d\t%l\t%l\n", st->pid, st->share, st->runtime);
+
+  printf("Scanner: %l pages scanned, %l merged (%l into the zero page), %l stable pages\n",
+         total.pagesScanned, total.pagesMerged, total.zeroPagesMerged, total.stablePages);
+  printf("System: %l free pages, %l superpages\n", total.freePages, total.superpages);
+  printf("Swap: %l of %l pages used, %l paged out, %l paged in\n",
+         total.swapUsed, total.swapTotal, total.pagesOut, total.pagesIn);
+  printf("----------------------\n");
+}
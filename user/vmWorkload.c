@@ -1,5 +1,6 @@
 #include "./../kernel/types.h"
 #include "./../kernel/stat.h"
+#include "./../kernel/riscv.h"
 #include "./../user/user.h"
 
 void workload0() {
@@ -7,8 +8,22 @@ void workload0() {
     ;
 }
 
+// Fills the heap with identical pages and keeps them around,
+// so that the VMM can merge them with each other and across VMs.
 void workload1() {
+  int npages = 256;
+  char *mem = sbrk(npages * PGSIZE);
+  if (mem == (char *) -1) {
+    printf("Workload 1: sbrk failed\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < npages; i++)
+    for (int j = 0; j < PGSIZE; j++)
+      mem[(i * PGSIZE) + j] = (char) (j % 251);
 
+  for (;;)
+    sleep(100);
 }
 
 void workload2() {